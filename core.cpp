@@ -0,0 +1,860 @@
+#include "core.hpp"
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <unordered_set>
+#include <utility>
+#include "exception.hpp"
+#include "factory.hpp"
+#include "helper.hpp"
+#include "reader.hpp"
+
+namespace {
+MalTypePtr eval_str(const std::string& src, const EnvPtr& env)
+{
+    auto ast = Reader(src).parse();
+    HOOLIB_THROW_UNLESS(ast, "invalid src");
+    return mal_eval(ast, env);
+}
+}  // namespace
+
+namespace mal::core {
+std::unordered_map<std::string, std::shared_ptr<MalFunction>> ns()
+{
+    return {
+        {"+", mal::arithmetic(MalArithmetic::Op::ADD)},
+        {"-", mal::arithmetic(MalArithmetic::Op::SUB)},
+        {"*", mal::arithmetic(MalArithmetic::Op::MUL)},
+        {"/", mal::arithmetic(MalArithmetic::Op::DIV)},
+
+        {"pr-str",
+         mal::function([](auto&& args) {
+             std::string out;
+             mal::helper::print_all(out, args, " ", true);
+             return mal::make_shared<MalString>(std::move(out));
+         })},
+        {"str",
+         mal::function([](auto&& args) {
+             std::string out;
+             mal::helper::print_all(out, args, "", false);
+             return mal::make_shared<MalString>(std::move(out));
+         })},
+        {"prn",
+         mal::function([](auto&& args) {
+             std::string out;
+             mal::helper::print_all(out, args, " ", true);
+             out += '\n';
+             mal::helper::write_output(out);
+             return mal::nil();
+         })},
+        {"println",
+         mal::function([](auto&& args) {
+             std::string out;
+             mal::helper::print_all(out, args, " ", false);
+             out += '\n';
+             mal::helper::write_output(out);
+             return mal::nil();
+         })},
+
+        {"subs",
+         mal::function([](auto&& args) {
+             HOOLIB_THROW_UNLESS(args.size() == 2 || args.size() == 3,
+                                 "invalid number of arguments");
+             auto str = args[0]->as_string();
+             auto start = args[1]->as_integer();
+             HOOLIB_THROW_UNLESS(str && start, "invalid argument");
+             long long int size = str->view().size(), end = size;
+             if (args.size() == 3) {
+                 auto end_arg = args[2]->as_integer();
+                 HOOLIB_THROW_UNLESS(end_arg, "invalid argument");
+                 end = end_arg->get();
+             }
+             HOOLIB_THROW_UNLESS(
+                 0 <= start->get() && start->get() <= end && end <= size,
+                 "invalid argument");
+             return str->slice(start->get(), end - start->get());
+         })},
+        {"split", mal::builtin([](const MalString& str, const MalString& sep) {
+             // an empty separator splits str into chars
+             auto src = str.view(), delim = sep.view();
+             std::vector<MalTypePtr> ret_src;
+             if (delim.empty()) {
+                 for (size_t i = 0; i < src.size(); i++)
+                     ret_src.push_back(str.slice(i, 1));
+                 return mal::list(std::move(ret_src));
+             }
+             size_t pos = 0;
+             while (true) {
+                 auto found = src.find(delim, pos);
+                 if (found == std::string_view::npos) break;
+                 ret_src.push_back(str.slice(pos, found - pos));
+                 pos = found + delim.size();
+             }
+             ret_src.push_back(str.slice(pos, src.size() - pos));
+             return mal::list(std::move(ret_src));
+         })},
+        {"join",
+         mal::function([](auto&& args) {
+             // (join coll) or (join sep coll). The items are printed as str
+             // does.
+             HOOLIB_THROW_UNLESS(args.size() == 1 || args.size() == 2,
+                                 "invalid number of arguments");
+             auto seq = args[args.size() - 1]->as_sequential();
+             HOOLIB_THROW_UNLESS(seq, "invalid argument");
+             std::string sep;
+             if (args.size() == 2) args[0]->print(sep, false);
+             std::string out;
+             mal::helper::print_all(out, seq->get(), sep.c_str(), false);
+             return mal::make_shared<MalString>(std::move(out));
+         })},
+        {"index-of",
+         mal::function([](auto&& args) -> MalTypePtr {
+             // (index-of s value) or (index-of s value from). nil if not
+             // found.
+             HOOLIB_THROW_UNLESS(args.size() == 2 || args.size() == 3,
+                                 "invalid number of arguments");
+             auto str = args[0]->as_string();
+             auto value = args[1]->as_string();
+             HOOLIB_THROW_UNLESS(str && value, "invalid argument");
+             long long int from = 0;
+             if (args.size() == 3) {
+                 auto from_arg = args[2]->as_integer();
+                 HOOLIB_THROW_UNLESS(from_arg && from_arg->get() >= 0,
+                                     "invalid argument");
+                 from = from_arg->get();
+             }
+             auto found = str->view().find(value->view(), from);
+             if (found == std::string_view::npos) return mal::nil();
+             return mal::int_(found);
+         })},
+        {"starts-with?",
+         mal::builtin([](const MalString& str, const MalString& prefix) {
+             auto src = str.view();
+             return mal::boolean(src.substr(0, prefix.view().size()) ==
+                                 prefix.view());
+         })},
+        {"trim", mal::builtin([](const MalString& str) {
+             auto src = str.view();
+             size_t begin = 0, end = src.size();
+             while (begin < end && std::isspace((unsigned char)src[begin]))
+                 begin++;
+             while (begin < end && std::isspace((unsigned char)src[end - 1]))
+                 end--;
+             return str.slice(begin, end - begin);
+         })},
+        {"string-builder",
+         mal::function([](auto&& args) {
+             HOOLIB_THROW_UNLESS(args.size() == 0,
+                                 "invalid number of arguments");
+             return mal::make_shared<MalStringBuilder>();
+         })},
+        {"sb-append!",
+         mal::function([](auto&& args) {
+             HOOLIB_THROW_UNLESS(args.size() >= 1,
+                                 "invalid number of arguments");
+             auto sb = args[0]->as_string_builder();
+             HOOLIB_THROW_UNLESS(sb, "invalid argument");
+             mal::helper::print_all(
+                 sb->get(), MalFunction::Args(args.begin() + 1, args.end()),
+                 "", false);
+             return sb;
+         })},
+        {"sb->str", mal::builtin([](const MalStringBuilder& sb) {
+             return mal::string(sb.get());
+         })},
+        {"with-out-str*", mal::builtin([](MalFunction& body) {
+             // The output of body goes into buffer. See with-out-str.
+             std::string buffer;
+             auto saved = std::exchange(mal::helper::output_buffer(), &buffer);
+             try {
+                 body.callN(MalFunction::Args(nullptr, nullptr));
+             }
+             catch (...) {
+                 mal::helper::output_buffer() = saved;
+                 throw;
+             }
+             mal::helper::output_buffer() = saved;
+             return mal::make_shared<MalString>(std::move(buffer));
+         })},
+
+        {"list",
+         mal::function([](auto&& args) {
+             auto src = std::vector<MalTypePtr>(args.begin(), args.end());
+             return mal::make_shared<MalList>(src);
+         })},
+        {"list?", mal::builtin([](const MalTypePtr& arg) {
+             return mal::boolean(bool(arg->as_list()));
+         })},
+
+        {"empty?", mal::builtin([](const MalTypePtr& arg) {
+             if (auto lazy_seq = arg->as_lazy_seq())
+                 return mal::boolean(lazy_seq->empty());
+             auto seq = arg->as_sequential();
+             HOOLIB_THROW_UNLESS(seq, "invalid argument");
+             return mal::boolean(seq->get().empty());
+         })},
+
+        {"count", mal::builtin([](const MalTypePtr& arg) {
+             if (arg->as_nil()) return mal::int_(0);
+             if (auto lazy_seq = arg->as_lazy_seq()) {
+                 long long int count = 0;
+                 lazy_seq->each([&](auto&&) { return ++count; });
+                 return mal::int_(count);
+             }
+             auto seq = arg->as_sequential();
+             HOOLIB_THROW_UNLESS(seq, "invalid argument");
+             return mal::int_(seq->get().size());
+         })},
+
+        {"cons",
+         mal::builtin([](const MalTypePtr& head,
+                         const MalTypePtr& tail_arg) -> MalTypePtr {
+             if (auto lazy_seq = tail_arg->as_lazy_seq())
+                 return mal::lazy::cons(head, lazy_seq);
+             auto tail = tail_arg->as_sequential();
+             HOOLIB_THROW_UNLESS(tail, "invalid argument");
+             std::vector<MalTypePtr> new_list;
+             new_list.reserve(tail->get().size() + 1);
+             new_list.push_back(head);
+             std::copy(HOOLIB_RANGE(tail->get()), std::back_inserter(new_list));
+             return mal::list(std::move(new_list));
+         })},
+
+        {"concat",
+         mal::function([](auto&& args) {
+             std::vector<MalTypePtr> ret_list;
+             for (auto&& arg : args) {
+                 auto src_list = arg->as_sequential();
+                 HOOLIB_THROW_UNLESS(src_list, "invalid argument");
+                 std::copy(HOOLIB_RANGE(src_list->get()),
+                           std::back_inserter(ret_list));
+             }
+             return mal::list(std::move(ret_list));
+         })},
+
+        {"read-string",
+         mal::function([](auto&& args) {
+             HOOLIB_THROW_UNLESS(args.size() == 1,
+                                 "invalid number of argument");
+             auto src = args[0]->as_string();
+             HOOLIB_THROW_UNLESS(src, "invalid argument");
+             return Reader(src->get()).parse();
+         })},
+        {"slurp",
+         mal::function([](auto&& args) {
+             HOOLIB_THROW_UNLESS(args.size() == 1,
+                                 "invalid number of argument");
+             return mal::string(
+                 HooLib::read_file_all(args[0]->as_string()->get()));
+         })},
+
+        {"nth",
+         mal::builtin([](const MalTypePtr& arg, const MalInteger& idx) {
+             if (auto lazy_seq = arg->as_lazy_seq()) {
+                 HOOLIB_THROW_UNLESS(idx.get() >= 0, "invalid argument");
+                 MalTypePtr found;
+                 auto left = idx.get();
+                 lazy_seq->each([&](auto&& item) {
+                     if (left-- == 0) found = item;
+                     return !found;
+                 });
+                 HOOLIB_THROW_UNLESS(found, "invalid argument");
+                 return found;
+             }
+             auto seq = arg->as_sequential();
+             HOOLIB_THROW_UNLESS(seq, "invalid argument");
+             HOOLIB_THROW_UNLESS(
+                 static_cast<size_t>(idx.get()) < seq->get().size(),
+                 "invalid argument");
+             return seq->get()[idx.get()];
+         })},
+        {"first", mal::builtin([](const MalTypePtr& arg) -> MalTypePtr {
+             if (auto lazy_seq = arg->as_lazy_seq()) return lazy_seq->first();
+             auto seq = arg->as_sequential();
+             HOOLIB_THROW_UNLESS(seq || arg->as_nil(), "invalid argument");
+             if (!seq || seq->get().empty()) return mal::nil();
+             return seq->get()[0];
+         })},
+        {"rest", mal::builtin([](const MalTypePtr& arg) -> MalTypePtr {
+             if (auto lazy_seq = arg->as_lazy_seq()) return lazy_seq->rest();
+             auto seq = arg->as_sequential();
+             if (!seq || seq->get().size() <= 1) return mal::list();
+             return mal::list(std::vector<MalTypePtr>(seq->get().begin() + 1,
+                                                      seq->get().end()));
+         })},
+
+        {"=", mal::builtin([](const MalTypePtr& lhs, const MalTypePtr& rhs) {
+             return mal::boolean(lhs->is_equal_to(rhs));
+         })},
+        {"<", mal::arithmetic(MalArithmetic::Op::LT)},
+        {"<=", mal::arithmetic(MalArithmetic::Op::LE)},
+        {">", mal::arithmetic(MalArithmetic::Op::GT)},
+        {">=", mal::arithmetic(MalArithmetic::Op::GE)},
+
+        {"atom",
+         mal::function([](auto&& args) {
+             HOOLIB_THROW_UNLESS(args.size() == 1,
+                                 "invalid number of argument");
+             HOOLIB_THROW_UNLESS(args[0], "invalid argument");
+             return mal::atom(args[0]);
+         })},
+        {"atom?",
+         mal::function([](auto&& args) {
+             HOOLIB_THROW_UNLESS(args.size() == 1,
+                                 "invalid number of argument");
+             auto value = args[0]->as_atom();
+             return mal::boolean(value != nullptr);
+         })},
+        {"deref",
+         mal::function([](auto&& args) {
+             HOOLIB_THROW_UNLESS(args.size() == 1,
+                                 "invalid number of argument");
+             auto src = args[0]->as_atom();
+             HOOLIB_THROW_UNLESS(src, "invalid argument");
+             return src->deref();
+         })},
+        {"reset!",
+         mal::function([](auto&& args) {
+             HOOLIB_THROW_UNLESS(args.size() == 2,
+                                 "invalid number of argument");
+             auto atm = args[0]->as_atom();
+             auto val = args[1];
+             HOOLIB_THROW_UNLESS(atm && val, "invalid argument");
+             atm->set_ref(val);
+             return val;
+         })},
+        {"swap!",
+         mal::function([](auto&& args) {
+             HOOLIB_THROW_UNLESS(args.size() >= 2,
+                                 "invalid number of arguments");
+             auto atm = args[0]->as_atom();
+             auto func = args[1]->as_function();
+             HOOLIB_THROW_UNLESS(atm && func, "invalid argument");
+
+             MalTypePtr res;
+             switch (args.size()) {
+                 case 2:
+                     res = func->call1(atm->deref());
+                     break;
+                 case 3:
+                     res = func->call2(atm->deref(), args[2]);
+                     break;
+                 default: {
+                     // create the argument
+                     std::vector<MalTypePtr> new_args;
+                     new_args.push_back(atm->deref());
+                     std::copy(args.begin() + 2, args.end(),
+                               std::back_inserter(new_args));
+                     res = func->callN(MalFunction::Args(new_args));
+                 }
+             }
+             atm->set_ref(res);
+             return res;
+         })},
+
+        {"throw",
+         mal::function([](auto&& args) {
+             HOOLIB_THROW_UNLESS(args.size() == 1,
+                                 "invalid number of arguments");
+             MAL_THROW(args[0]);
+             return mal::nil();  // dummy
+         })},
+
+        {"apply",
+         mal::function([](auto&& args) {
+             auto [ func, list ] = mal::helper::apply_args(args);
+             return func->callN(MalFunction::Args(list));
+         })},
+        {"map",
+         mal::function([](auto&& args) -> MalTypePtr {
+             HOOLIB_THROW_UNLESS(args.size() == 1 || args.size() == 2,
+                                 "invalid number of arguments");
+             if (args.size() == 1)
+                 return mal::helper::transducer(
+                     MalTransducer::Stage::Kind::MAP, args[0]);
+             auto func = args[0]->as_function();
+             HOOLIB_THROW_UNLESS(func, "invalid argument");
+             const auto& coll = args[1];
+             // lazy over a lazy seq, which may be infinite
+             if (coll->as_lazy_seq()) return mal::lazy::map(func, coll);
+             auto seq = coll->as_sequential();
+             HOOLIB_THROW_UNLESS(seq, "invalid argument");
+             std::vector<MalTypePtr> ret_src;
+             ret_src.reserve(seq->get().size());
+             for (auto&& item : seq->get()) ret_src.push_back(func->call1(item));
+             return mal::list(std::move(ret_src));
+         })},
+
+        {"lazy-seq*", mal::builtin([](const MalTypePtr& thunk) {
+             auto func = thunk->as_function();
+             HOOLIB_THROW_UNLESS(func, "invalid argument");
+             return mal::lazy::from_thunk(func);
+         })},
+        {"lazy-seq?", mal::builtin([](const MalTypePtr& arg) {
+             return mal::boolean(bool(arg->as_lazy_seq()));
+         })},
+        {"range",
+         mal::function([](auto&& args) {
+             // (range), (range end), (range start end) or
+             // (range start end step)
+             HOOLIB_THROW_UNLESS(args.size() <= 3,
+                                 "invalid number of arguments");
+             long long int nums[3] = {0, 0, 1};
+             for (size_t i = 0; i < args.size(); i++) {
+                 auto num = args[i]->as_integer();
+                 HOOLIB_THROW_UNLESS(num, "invalid argument");
+                 nums[i] = num->get();
+             }
+             if (args.size() == 0) return mal::lazy::range(0, std::nullopt, 1);
+             if (args.size() == 1) return mal::lazy::range(0, nums[0], 1);
+             return mal::lazy::range(nums[0], nums[1], nums[2]);
+         })},
+        {"filter",
+         mal::function([](auto&& args) -> MalTypePtr {
+             HOOLIB_THROW_UNLESS(args.size() == 1 || args.size() == 2,
+                                 "invalid number of arguments");
+             if (args.size() == 1)
+                 return mal::helper::transducer(
+                     MalTransducer::Stage::Kind::FILTER, args[0]);
+             auto func = args[0]->as_function();
+             HOOLIB_THROW_UNLESS(func, "invalid argument");
+             auto seq = args[1]->as_sequential();
+             if (!seq) return mal::lazy::filter(func, args[1]);
+             std::vector<MalTypePtr> ret_src;
+             ret_src.reserve(seq->get().size());
+             for (auto&& item : seq->get()) {
+                 auto ret = func->call1(item);
+                 if ((ret->as_nil() || ret->as_false()) == false)
+                     ret_src.push_back(item);
+             }
+             return mal::list(ret_src);
+         })},
+        {"remove",
+         mal::function([](auto&& args) -> MalTypePtr {
+             HOOLIB_THROW_UNLESS(args.size() == 1 || args.size() == 2,
+                                 "invalid number of arguments");
+             if (args.size() == 1)
+                 return mal::helper::transducer(
+                     MalTransducer::Stage::Kind::REMOVE, args[0]);
+             auto func = args[0]->as_function();
+             HOOLIB_THROW_UNLESS(func, "invalid argument");
+             auto seq = args[1]->as_sequential();
+             if (!seq) return mal::lazy::remove(func, args[1]);
+             std::vector<MalTypePtr> ret_src;
+             ret_src.reserve(seq->get().size());
+             for (auto&& item : seq->get()) {
+                 auto ret = func->call1(item);
+                 if ((ret->as_nil() || ret->as_false()) == true)
+                     ret_src.push_back(item);
+             }
+             return mal::list(ret_src);
+         })},
+        {"take",
+         mal::function([](auto&& args) -> MalTypePtr {
+             HOOLIB_THROW_UNLESS(args.size() == 1 || args.size() == 2,
+                                 "invalid number of arguments");
+             auto n = args[0]->as_integer();
+             HOOLIB_THROW_UNLESS(n, "invalid argument");
+             if (args.size() == 1)
+                 return mal::make_shared<MalTransducer>(
+                     std::vector<MalTransducer::Stage>{
+                         {MalTransducer::Stage::Kind::TAKE, nullptr, n->get()}});
+             return mal::lazy::take(n->get(), args[1]);
+         })},
+        {"drop",
+         mal::builtin([](const MalInteger& n, const MalTypePtr& coll) {
+             return mal::lazy::drop(n.get(), coll);
+         })},
+        {"iterate",
+         mal::builtin([](const MalTypePtr& func_arg, const MalTypePtr& x) {
+             auto func = func_arg->as_function();
+             HOOLIB_THROW_UNLESS(func, "invalid argument");
+             return mal::lazy::iterate(func, x);
+         })},
+
+        {"transduce",
+         mal::function([](auto&& args) {
+             // (transduce xform f coll) or (transduce xform f init coll)
+             HOOLIB_THROW_UNLESS(args.size() == 3 || args.size() == 4,
+                                 "invalid number of arguments");
+             auto xform = args[0]->as_transducer();
+             auto func = args[1]->as_function();
+             HOOLIB_THROW_UNLESS(xform && func, "invalid argument");
+             auto acc = args.size() == 4
+                            ? args[2]
+                            : func->callN(MalFunction::Args(nullptr, nullptr));
+             xform->each(args[args.size() - 1], [&](auto&& item) {
+                 acc = func->call2(acc, item);
+             });
+             return acc;
+         })},
+        {"into",
+         mal::function([](auto&& args) {
+             // (into to coll) or (into to xform coll)
+             HOOLIB_THROW_UNLESS(args.size() == 2 || args.size() == 3,
+                                 "invalid number of arguments");
+             auto xform = mal::helper::transducer_or_all(
+                 args.size() == 3 ? &args[1] : nullptr);
+             std::vector<MalTypePtr> items;
+             xform->each(args[args.size() - 1],
+                         [&](auto&& item) { items.push_back(item); });
+             return mal::helper::into(args[0], std::move(items));
+         })},
+        {"sequence",
+         mal::function([](auto&& args) {
+             // (sequence coll) or (sequence xform coll)
+             HOOLIB_THROW_UNLESS(args.size() == 1 || args.size() == 2,
+                                 "invalid number of arguments");
+             if (args.size() == 1) return mal::lazy::seq(args[0]);
+             auto xform = args[0]->as_transducer();
+             HOOLIB_THROW_UNLESS(xform, "invalid argument");
+             return xform->sequence(args[1]);
+         })},
+        {"reduce",
+         mal::function([](auto&& args) {
+             // (reduce f coll) or (reduce f init coll)
+             HOOLIB_THROW_UNLESS(args.size() == 2 || args.size() == 3,
+                                 "invalid number of arguments");
+             auto func = args[0]->as_function();
+             HOOLIB_THROW_UNLESS(func, "invalid argument");
+             MalTypePtr acc = args.size() == 3 ? args[1] : nullptr;
+             mal::helper::each_item(args[args.size() - 1], [&](auto&& item) {
+                 acc = acc ? func->call2(acc, item) : item;
+                 return true;
+             });
+             // (reduce f []) is (f)
+             if (!acc) acc = func->callN(MalFunction::Args(nullptr, nullptr));
+             return acc;
+         })},
+        {"sort",
+         mal::function([](auto&& args) {
+             // (sort coll) or (sort comp coll), where (comp a b) is
+             // negative or true if a comes before b
+             HOOLIB_THROW_UNLESS(args.size() == 1 || args.size() == 2,
+                                 "invalid number of arguments");
+             auto items = mal::helper::items_of(args[args.size() - 1]);
+             if (args.size() == 1) {
+                 std::stable_sort(HOOLIB_RANGE(items), mal::helper::is_less);
+                 return mal::list(items);
+             }
+             auto comp = args[0]->as_function();
+             HOOLIB_THROW_UNLESS(comp, "invalid argument");
+             std::stable_sort(HOOLIB_RANGE(items),
+                              [&](auto&& lhs, auto&& rhs) {
+                                  auto ret = comp->call2(lhs, rhs);
+                                  if (auto num = ret->as_integer())
+                                      return num->get() < 0;
+                                  return !ret->as_nil() && !ret->as_false();
+                              });
+             return mal::list(items);
+         })},
+        {"sort-by",
+         mal::builtin([](MalFunction& keyfn, const MalTypePtr& coll) {
+             // keyfn is called once per item
+             auto items = mal::helper::items_of(coll);
+             std::vector<std::pair<MalTypePtr, size_t>> keys;
+             keys.reserve(items.size());
+             for (size_t i = 0; i < items.size(); i++)
+                 keys.emplace_back(keyfn.call1(items[i]), i);
+             std::stable_sort(HOOLIB_RANGE(keys), [](auto&& lhs, auto&& rhs) {
+                 return mal::helper::is_less(lhs.first, rhs.first);
+             });
+             std::vector<MalTypePtr> sorted;
+             sorted.reserve(items.size());
+             for (auto && [ key, i ] : keys) sorted.push_back(items[i]);
+             return mal::list(sorted);
+         })},
+        {"frequencies", mal::builtin([](const MalTypePtr& coll) {
+             std::unordered_map<std::string, long long int> counts;
+             mal::helper::each_item(coll, [&](auto&& item) {
+                 counts[mal::helper::key_of(item)]++;
+                 return true;
+             });
+             MalHashMap::Container cont;
+             cont.reserve(counts.size());
+             for (auto && [ key, count ] : counts)
+                 cont.emplace(key, mal::int_(count));
+             return mal::hash_map(std::move(cont));
+         })},
+        {"group-by",
+         mal::builtin([](MalFunction& keyfn, const MalTypePtr& coll) {
+             std::unordered_map<std::string, std::vector<MalTypePtr>> groups;
+             mal::helper::each_item(coll, [&](auto&& item) {
+                 groups[mal::helper::key_of(keyfn.call1(item))].push_back(item);
+                 return true;
+             });
+             MalHashMap::Container cont;
+             cont.reserve(groups.size());
+             for (auto && [ key, items ] : groups)
+                 cont.emplace(key, mal::vector(items));
+             return mal::hash_map(std::move(cont));
+         })},
+        {"distinct", mal::builtin([](const MalTypePtr& coll) {
+             // Integers and strings are looked up in a hash set. Anything
+             // else is compared with those kept so far.
+             std::unordered_set<long long int> ints;
+             std::unordered_set<std::string_view> strs;
+             std::vector<MalTypePtr> items;
+             mal::helper::each_item(coll, [&](auto&& item) {
+                 bool is_new;
+                 if (auto num = item->as_integer())
+                     is_new = ints.insert(num->get()).second;
+                 else if (auto str = item->as_string())
+                     is_new = strs.insert(str->view()).second;
+                 else
+                     is_new = std::none_of(
+                         HOOLIB_RANGE(items),
+                         [&](auto&& kept) { return kept->is_equal_to(item); });
+                 if (is_new) items.push_back(item);
+                 return true;
+             });
+             return mal::list(items);
+         })},
+        {"partition",
+         mal::function([](auto&& args) {
+             // (partition n coll) or (partition n step coll). Items left
+             // over for a partition shorter than n are dropped.
+             HOOLIB_THROW_UNLESS(args.size() == 2 || args.size() == 3,
+                                 "invalid number of arguments");
+             auto n = args[0]->as_integer();
+             auto step = args[args.size() - 2]->as_integer();
+             HOOLIB_THROW_UNLESS(n && step && n->get() > 0 && step->get() > 0,
+                                 "invalid argument");
+             auto size = static_cast<size_t>(n->get());
+             auto stride = static_cast<size_t>(step->get());
+             auto items = mal::helper::items_of(args[args.size() - 1]);
+             std::vector<MalTypePtr> parts;
+             if (items.size() >= size)
+                 parts.reserve((items.size() - size) / stride + 1);
+             for (size_t i = 0; i + size <= items.size(); i += stride)
+                 parts.push_back(mal::list(std::vector<MalTypePtr>(
+                     items.begin() + i, items.begin() + i + size)));
+             return mal::list(parts);
+         })},
+        {"comp",
+         mal::function([](auto&& args) -> MalTypePtr {
+             // Transducers are chained into one, whose items go through the
+             // leftmost first. Otherwise ((comp f g) x) is (f (g x)).
+             std::vector<MalTransducer::Stage> stages;
+             std::vector<std::shared_ptr<MalFunction>> funcs;
+             for (auto&& arg : args) {
+                 if (auto xform = arg->as_transducer())
+                     stages.insert(stages.end(), HOOLIB_RANGE(xform->stages()));
+                 else if (auto func = arg->as_function())
+                     funcs.push_back(func);
+                 else
+                     HOOLIB_THROW_UNLESS(false, "invalid argument");
+             }
+             HOOLIB_THROW_UNLESS(stages.empty() || funcs.empty(),
+                                 "invalid argument");
+             if (!stages.empty())
+                 return mal::make_shared<MalTransducer>(std::move(stages));
+             return mal::function([funcs](auto&& args) {
+                 if (funcs.empty()) {
+                     HOOLIB_THROW_UNLESS(args.size() == 1,
+                                         "invalid number of arguments");
+                     return args[0];
+                 }
+                 auto ret = funcs.back()->callN(args);
+                 for (auto it = funcs.rbegin() + 1; it != funcs.rend(); ++it)
+                     ret = (*it)->call1(ret);
+                 return ret;
+             });
+         })},
+
+        {"time-ms",
+         mal::function([](auto&& args) {
+             HOOLIB_THROW_UNLESS(args.size() == 0,
+                                 "invalid number of arguments");
+             auto now = std::chrono::steady_clock::now().time_since_epoch();
+             return mal::int_(
+                 std::chrono::duration_cast<std::chrono::milliseconds>(now)
+                     .count());
+         })},
+
+        {"nil?",
+         mal::function([](auto&& args) {
+             HOOLIB_THROW_UNLESS(args.size() == 1,
+                                 "invalid number of arguments");
+             return mal::boolean(args[0]->as_nil() != nullptr);
+         })},
+        {"true?",
+         mal::function([](auto&& args) {
+             HOOLIB_THROW_UNLESS(args.size() == 1,
+                                 "invalid number of arguments");
+             return mal::boolean(args[0]->as_true() != nullptr);
+         })},
+        {"false?",
+         mal::function([](auto&& args) {
+             HOOLIB_THROW_UNLESS(args.size() == 1,
+                                 "invalid number of arguments");
+             return mal::boolean(args[0]->as_false() != nullptr);
+         })},
+        {"symbol?",
+         mal::function([](auto&& args) {
+             HOOLIB_THROW_UNLESS(args.size() == 1,
+                                 "invalid number of arguments");
+             return mal::boolean(args[0]->as_symbol() != nullptr);
+         })},
+
+        {"symbol",
+         mal::function([](auto&& args) {
+             HOOLIB_THROW_UNLESS(args.size() == 1,
+                                 "invalid number of arguments");
+             auto name = args[0]->as_string();
+             HOOLIB_THROW_UNLESS(name, "invalid argument");
+             return mal::symbol(name->get());
+         })},
+        {"keyword",
+         mal::function([](auto&& args) -> MalTypePtr {
+             HOOLIB_THROW_UNLESS(args.size() == 1,
+                                 "invalid number of arguments");
+             auto name = args[0]->as_string();
+             HOOLIB_THROW_UNLESS(name, "invalid argument");
+             if (mal::helper::is_keyword(name->get())) return name;
+             return mal::keyword(mal::helper::string2keyword(name->get()));
+         })},
+        {"keyword?",
+         mal::function([](auto&& args) -> MalTypePtr {
+             HOOLIB_THROW_UNLESS(args.size() == 1,
+                                 "invalid number of arguments");
+             auto name = args[0]->as_string();
+             if (name == nullptr) return mal::false_();
+             return mal::boolean(mal::helper::is_keyword(name->get()));
+         })},
+        {"vector",
+         mal::function([](auto&& args) {
+             return mal::vector(std::vector<MalTypePtr>(HOOLIB_RANGE(args)));
+         })},
+        {"vector?",
+         mal::function([](auto&& args) {
+             HOOLIB_THROW_UNLESS(args.size() == 1,
+                                 "invalid number of arguments");
+             return mal::boolean(args[0]->as_vector() != nullptr);
+         })},
+        {"sequential?",
+         mal::function([](auto&& args) {
+             HOOLIB_THROW_UNLESS(args.size() == 1,
+                                 "invalid number of arguments");
+             return mal::boolean(args[0]->as_sequential() != nullptr);
+         })},
+
+        {"hash-map",
+         mal::function([](auto&& args) {
+             HOOLIB_THROW_UNLESS(args.size() % 2 == 0,
+                                 "invalid number of arguments");
+             return mal::hash_map(
+                 mal::helper::make_hash_map_container(HOOLIB_RANGE(args)));
+         })},
+        {"map?",
+         mal::function([](auto&& args) {
+             HOOLIB_THROW_UNLESS(args.size() == 1,
+                                 "invalid number of arguments");
+             return mal::boolean(args[0]->as_hash_map() != nullptr);
+         })},
+        {"assoc",
+         mal::function([](auto&& args) {
+             HOOLIB_THROW_UNLESS(args.size() >= 1 && args.size() % 2 == 1,
+                                 "invalid number of arguments");
+             auto org_hash = args[0]->as_hash_map();
+             HOOLIB_THROW_UNLESS(org_hash, "invalid argument");
+             auto src = org_hash->data();
+             mal::helper::insert_odd_even_list(src, args.begin() + 1,
+                                               args.end());
+             return mal::hash_map(src);
+         })},
+        {"dissoc",
+         mal::function([](auto&& args) {
+             HOOLIB_THROW_UNLESS(args.size() >= 1,
+                                 "invalid number of arguments");
+             auto org_hash = args[0]->as_hash_map();
+             HOOLIB_THROW_UNLESS(org_hash, "invalid argument");
+             auto src = org_hash->data();
+             for (auto it = args.begin() + 1; it != args.end(); ++it) {
+                 auto key = (*it)->as_string();
+                 HOOLIB_THROW_UNLESS(key, "invalid argument");
+                 src.erase(key->get());
+             }
+             return mal::hash_map(src);
+         })},
+        {"get",
+         mal::function([](auto&& args) -> MalTypePtr {
+             HOOLIB_THROW_UNLESS(args.size() == 2,
+                                 "invalid number of arguments");
+             if (args[0]->as_nil()) return mal::nil();
+             auto hash = args[0]->as_hash_map();
+             auto key = args[1]->as_string();
+             HOOLIB_THROW_UNLESS(hash && key, "invalid argument");
+             auto ret = hash->get_if(key->get());
+             if (ret == nullptr) return mal::nil();
+             return ret;
+         })},
+        {"contains?",
+         mal::function([](auto&& args) -> MalTypePtr {
+             HOOLIB_THROW_UNLESS(args.size() == 2,
+                                 "invalid number of arguments");
+             auto hash = args[0]->as_hash_map();
+             auto key = args[1]->as_string();
+             HOOLIB_THROW_UNLESS(hash && key, "invalid argument");
+             auto ret = hash->get_if(key->get());
+             return mal::boolean(ret != nullptr);
+         })},
+        {"keys",
+         mal::function([](auto&& args) -> MalTypePtr {
+             HOOLIB_THROW_UNLESS(args.size() == 1,
+                                 "invalid number of arguments");
+             auto hash = args[0]->as_hash_map();
+             HOOLIB_THROW_UNLESS(hash, "invalid argument");
+             std::vector<MalTypePtr> src;
+             for (auto && [ k, v ] : hash->data())
+                 src.push_back(mal::string(k));
+             return mal::list(src);
+         })},
+        {"vals",
+         mal::function([](auto&& args) -> MalTypePtr {
+             HOOLIB_THROW_UNLESS(args.size() == 1,
+                                 "invalid number of arguments");
+             auto hash = args[0]->as_hash_map();
+             HOOLIB_THROW_UNLESS(hash, "invalid argument");
+             std::vector<MalTypePtr> src;
+             for (auto && [ k, v ] : hash->data()) src.push_back(v);
+             return mal::list(src);
+         })},
+
+    };
+}
+
+void init(const EnvPtr& repl_env)
+{
+    auto builtins = ns();
+    for (auto && [ name, func ] : builtins) repl_env->set(name, func);
+    builtins.at("apply")->set_apply();
+    builtins.at("throw")->set_throw();
+    for (auto&& name : {"+", "-", "*", "/", "=", "<", "<=", ">", ">=", "str",
+                        "list", "vector", "count"})
+        builtins.at(name)->set_pure();
+
+    // define not
+    eval_str("(def! not (fn* (a) (if a false true)))", repl_env);
+
+    // define lazy-seq, whose body is evaluated when the items are first
+    // needed
+    eval_str(
+        "(defmacro! lazy-seq (fn* (& body) `(lazy-seq* (fn* () (do ~@body)))))",
+        repl_env);
+
+    // define with-out-str, which returns what body prints as a string
+    eval_str(
+        "(defmacro! with-out-str (fn* (& body) `(with-out-str* (fn* () (do ~@body)))))",
+        repl_env);
+
+    // define load-file
+    eval_str(
+        R"***((def! load-file (fn* (f) (eval (read-string (str "(do " (slurp f) ")"))))))***",
+        repl_env);
+
+    repl_env->set("*host-language*", mal::string("C++"));
+}
+}  // namespace mal::core
@@ -0,0 +1,19 @@
+#pragma once
+#ifndef MAL_CORE_HPP
+#define MAL_CORE_HPP
+
+#include <string>
+#include <unordered_map>
+#include "env.hpp"
+
+// The builtins of stepA_mal, which the programs malc compiles share.
+namespace mal::core {
+std::unordered_map<std::string, std::shared_ptr<MalFunction>> ns();
+
+// Sets the builtins in repl_env and defines not, lazy-seq, with-out-str,
+// load-file and *host-language*. eval, which load-file calls, and *ARGV*
+// are left to the caller.
+void init(const EnvPtr& repl_env);
+}  // namespace mal::core
+
+#endif
@@ -1,10 +1,33 @@
 #include "env.hpp"
 #include "exception.hpp"
 
+MalTypePtr* Env::lookup(const std::string& key)
+{
+    if (map_) {
+        auto it = map_->find(key);
+        return it == map_->end() ? nullptr : &it->second;
+    }
+    for (auto&& binding : bindings_)
+        if (binding.first == key) return &binding.second;
+    return nullptr;
+}
+
 EnvPtr Env::find(const std::string& key)
 {
-    auto it = data_.find(key);
-    if (it != data_.end()) return shared_from_this();
-    if (outer_ == nullptr) MAL_THROW_STRING("'", key, "' not found");
-    return outer_->find(key);
+    for (auto env = this; env; env = env->outer_.get())
+        if (env->lookup(key)) return env->shared_from_this();
+    MAL_THROW_STRING("'", key, "' not found");
+}
+
+MalTypePtr Env::get(const std::string& key)
+{
+    if (auto value = get_if(key)) return value;
+    MAL_THROW_STRING("'", key, "' not found");
+}
+
+MalTypePtr Env::get_if(const std::string& key)
+{
+    for (auto env = this; env; env = env->outer_.get())
+        if (auto slot = env->lookup(key)) return *slot;
+    return nullptr;
 }
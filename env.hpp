@@ -2,6 +2,7 @@
 #ifndef MAL_ENV_HPP
 #define MAL_ENV_HPP
 
+#include <cstdint>
 #include <memory>
 #include <unordered_map>
 
@@ -13,16 +14,28 @@ using EnvPtr = std::shared_ptr<Env>;
 
 class Env : public std::enable_shared_from_this<Env> {
 private:
-    std::unordered_map<std::string, MalTypePtr> data_;
+    using Map = std::unordered_map<std::string, MalTypePtr>;
+    using Bindings = std::vector<std::pair<std::string, MalTypePtr>>;
+
+    // The root environment holds every global and is hashed. The others come
+    // from let* and function calls, have only a few bindings and are kept
+    // small, since deep recursion holds one of them per level.
+    std::unique_ptr<Map> map_;
+    Bindings bindings_;
     EnvPtr outer_;
+    bool is_complete_ = true;
+    inline static uint64_t generation_ = 0;
 
 public:
-    Env(EnvPtr outer = nullptr) : outer_(std::move(outer)) {}
+    Env(EnvPtr outer = nullptr) : outer_(std::move(outer))
+    {
+        if (!outer_) map_ = std::make_unique<Map>();
+    }
 
     template <class T>
     Env(EnvPtr outer, const std::vector<std::string>& binds,
         const HooLib::Range<T>& exprs)
-        : outer_(std::move(outer))
+        : Env(std::move(outer))
     {
         HOOLIB_THROW_UNLESS(
             binds.size() == static_cast<decltype(binds.size())>(exprs.size()),
@@ -32,21 +45,41 @@ public:
 
     void set(const std::string& key, const MalTypePtr& value)
     {
-        data_[key] = value;
+        if (map_) {
+            auto [ it, is_new ] = map_->try_emplace(key, value);
+            if (!is_new) {
+                it->second = value;
+                generation_++;
+            }
+            return;
+        }
+        if (auto slot = lookup(key)) {
+            *slot = value;
+            return;
+        }
+        bindings_.emplace_back(key, value);
     }
 
+    void reserve(size_t size) { bindings_.reserve(size); }
+    void clear() { bindings_.clear(); }
+
+    const EnvPtr& outer() const { return outer_; }
+
+    // incremented whenever a global is redefined, so that what was worked out
+    // from the globals can tell it's stale
+    static uint64_t generation() { return generation_; }
+
+    // false while let* is still adding bindings
+    bool is_complete() const { return is_complete_; }
+    void set_complete(bool complete) { is_complete_ = complete; }
+
+    // nullptr if key is not bound in this environment
+    MalTypePtr* lookup(const std::string& key);
+
     EnvPtr find(const std::string& key);
 
-    MalTypePtr get(const std::string& key) { return find(key)->data_[key]; }
-    MalTypePtr get_if(const std::string& key)
-    {
-        try {
-            return get(key);
-        }
-        catch (...) {
-            return nullptr;
-        }
-    }
+    MalTypePtr get(const std::string& key);
+    MalTypePtr get_if(const std::string& key);
 };
 
 #endif
@@ -57,7 +57,13 @@ inline std::shared_ptr<MalSymbol> symbol(const std::string& name)
 }
 inline std::shared_ptr<MalInteger> int_(long long int num)
 {
-    return make_shared<MalInteger>(num);
+    // small integers are shared like nil, true and false
+    constexpr long long int min = -128, max = 1023;
+    if (num < min || num > max) return make_shared<MalInteger>(num);
+    static std::shared_ptr<MalInteger> cache[max - min + 1];
+    auto& instance = cache[num - min];
+    if (!instance) instance = make_shared<MalInteger>(num);
+    return instance;
 }
 inline std::shared_ptr<MalAtom> atom(const MalTypePtr& ref)
 {
@@ -90,6 +96,32 @@ inline std::shared_ptr<MalHashMap> hash_map(MalHashMap::Container c)
     return ::mal::make_shared<MalHashMap>(std::move(c));
 }
 
+inline std::shared_ptr<MalFunction> function(MalFunction::Func func)
+{
+    return ::mal::make_shared<MalFunction>(std::move(func));
+}
+
+namespace detail {
+template <class F, class R, class C, class... Params>
+std::shared_ptr<MalFunction> builtin(F func, R (C::*)(Params...) const)
+{
+    return ::mal::make_shared<MalBuiltin<F, std::decay_t<Params>...>>(
+        std::move(func));
+}
+}  // namespace detail
+
+// e.g. mal::builtin([](const MalInteger& lhs, const MalInteger& rhs) {...})
+template <class F>
+std::shared_ptr<MalFunction> builtin(F func)
+{
+    return detail::builtin(std::move(func), &F::operator());
+}
+
+inline std::shared_ptr<MalFunction> arithmetic(MalArithmetic::Op op)
+{
+    return ::mal::make_shared<MalArithmetic>(op);
+}
+
 }  // namespace mal
 
 #endif
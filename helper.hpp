@@ -2,7 +2,9 @@
 #ifndef MAL_HELPER_HPP
 #define MAL_HELPER_HPP
 
+#include <algorithm>
 #include <iostream>
+#include "factory.hpp"
 #include "type.hpp"
 
 namespace mal::helper {
@@ -13,7 +15,7 @@ inline std::string string2keyword(const std::string& token)
     return prefix + token;
 }
 
-inline bool is_keyword(const std::string& src)
+inline bool is_keyword(std::string_view src)
 {
     return src.size() >= 1 && src[0] == (char)0xff;
 }
@@ -65,6 +67,153 @@ MalHashMap::Container make_hash_map_container(Iterator begin, Iterator end)
     return cont;
 }
 
+// input: (f a b ... seq)
+// output: f and the arguments a b ... followed by the items of seq
+template <class Args>
+std::tuple<std::shared_ptr<MalFunction>, std::vector<MalTypePtr>> apply_args(
+    const Args& args)
+{
+    HOOLIB_THROW_UNLESS(args.size() >= 2, "invalid number of arguments");
+    auto func = (*args.begin())->as_function();
+    HOOLIB_THROW_UNLESS(func, "invalid argument");
+    std::vector<MalTypePtr> list(args.begin() + 1, args.end() - 1);
+    const auto& last = *(args.end() - 1);
+    if (auto lazy_seq = last->as_lazy_seq()) {
+        lazy_seq->each([&](auto&& item) {
+            list.push_back(item);
+            return true;
+        });
+        return std::make_tuple(func, list);
+    }
+    auto seq = last->as_sequential();
+    HOOLIB_THROW_UNLESS(seq, "invalid argument");
+    std::copy(HOOLIB_RANGE(seq->get()), std::back_inserter(list));
+    return std::make_tuple(func, list);
+}
+
+// calls f with each item of a list, vector, lazy seq or nil until it
+// returns false
+template <class F>
+void each_item(const MalTypePtr& coll, F f)
+{
+    if (auto lazy_seq = coll->as_lazy_seq()) {
+        lazy_seq->each(f);
+        return;
+    }
+    if (coll->as_nil()) return;
+    auto seq = coll->as_sequential();
+    HOOLIB_THROW_UNLESS(seq, "invalid argument");
+    for (auto&& item : seq->get())
+        if (!f(item)) return;
+}
+
+// the items of coll in a vector of their own
+inline std::vector<MalTypePtr> items_of(const MalTypePtr& coll)
+{
+    if (auto seq = coll->as_sequential()) return seq->get();
+    std::vector<MalTypePtr> items;
+    each_item(coll, [&](auto&& item) {
+        items.push_back(item);
+        return true;
+    });
+    return items;
+}
+
+// sort's order: integers by value and strings by their chars
+inline bool is_less(const MalTypePtr& lhs, const MalTypePtr& rhs)
+{
+    auto lhs_int = lhs->as_integer(), rhs_int = rhs->as_integer();
+    if (lhs_int && rhs_int) return lhs_int->get() < rhs_int->get();
+    auto lhs_str = lhs->as_string(), rhs_str = rhs->as_string();
+    HOOLIB_THROW_UNLESS(lhs_str && rhs_str, "invalid argument");
+    return lhs_str->view() < rhs_str->view();
+}
+
+// the key of a hash-map made by frequencies and group-by
+inline const std::string& key_of(const MalTypePtr& value)
+{
+    auto key = value->as_string();
+    HOOLIB_THROW_UNLESS(key, "invalid argument");
+    return key->get();
+}
+
+// (map f), (filter pred) and so on, which have no collection
+inline std::shared_ptr<MalTransducer> transducer(
+    MalTransducer::Stage::Kind kind, const MalTypePtr& func_arg)
+{
+    auto func = func_arg->as_function();
+    HOOLIB_THROW_UNLESS(func, "invalid argument");
+    return mal::make_shared<MalTransducer>(
+        std::vector<MalTransducer::Stage>{{kind, func, 0}});
+}
+
+// the transducer of (into to xform coll), or one letting everything pass
+inline std::shared_ptr<MalTransducer> transducer_or_all(
+    const MalTypePtr* xform)
+{
+    if (!xform)
+        return mal::make_shared<MalTransducer>(
+            std::vector<MalTransducer::Stage>());
+    auto ret = (*xform)->as_transducer();
+    HOOLIB_THROW_UNLESS(ret, "invalid argument");
+    return ret;
+}
+
+// items added to to as conj does: appended to a vector, put in front of a
+// list one by one, or [key value] pairs put in a hash-map
+inline MalTypePtr into(const MalTypePtr& to, std::vector<MalTypePtr> items)
+{
+    if (auto vec = to->as_vector()) {
+        items.insert(items.begin(), HOOLIB_RANGE(vec->get()));
+        return mal::vector(items);
+    }
+    if (auto hash_map = to->as_hash_map()) {
+        auto cont = hash_map->data();
+        for (auto&& item : items) {
+            auto pair = item->as_sequential();
+            HOOLIB_THROW_UNLESS(pair && pair->get().size() == 2,
+                                "invalid argument");
+            auto key = pair->get()[0]->as_string();
+            HOOLIB_THROW_UNLESS(key, "invalid argument");
+            cont[key->get()] = pair->get()[1];
+        }
+        return mal::hash_map(std::move(cont));
+    }
+    std::reverse(items.begin(), items.end());
+    if (auto list = to->as_list())
+        items.insert(items.end(), HOOLIB_RANGE(list->get()));
+    else
+        HOOLIB_THROW_UNLESS(to->as_nil(), "invalid argument");
+    return mal::list(items);
+}
+
+// the printed forms of items separated by delim, appended to out
+template <class Args>
+void print_all(std::string& out, const Args& items, const char* delim,
+               bool print_readably)
+{
+    for (auto it = items.begin(); it != items.end(); ++it) {
+        if (it != items.begin()) out += delim;
+        (*it)->print(out, print_readably);
+    }
+}
+
+// Where prn and println write: the buffer of the innermost with-out-str,
+// or std::cout if it's nullptr
+inline std::string*& output_buffer()
+{
+    static std::string* buffer = nullptr;
+    return buffer;
+}
+
+inline void write_output(const std::string& out)
+{
+    if (auto buffer = output_buffer())
+        *buffer += out;
+    else
+        std::cout << out << std::flush;
+}
+
 }  // namespace mal::helper
 
 #endif
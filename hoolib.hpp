@@ -13,7 +13,11 @@
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <string_view>
 #include <vector>
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
 
 namespace HooLib {
 
@@ -31,10 +35,32 @@ inline std::string createErrorMsg(const std::string& what, const char* file,
     return ss.str();
 }
 
+// std::runtime_error whose message is made by createErrorMsg only when
+// what() is called, since many of them are caught and dropped unread
+class Error : public std::runtime_error {
+private:
+    std::string what_;
+    const char* file_;
+    int line_;
+    mutable std::string message_;
+
+public:
+    Error(std::string what, const char* file, int line)
+        : std::runtime_error(""), what_(std::move(what)), file_(file), line_(line)
+    {
+    }
+
+    const char* what() const noexcept override
+    {
+        if (message_.empty()) message_ = createErrorMsg(what_, file_, line_);
+        return message_.c_str();
+    }
+};
+
 #define HOOLIB_ERROR(msg) HooLib::createErrorMsg((msg), __FILE__, __LINE__)
-#define HOOLIB_THROW(msg)                            \
-    {                                                \
-        throw std::runtime_error(HOOLIB_ERROR(msg)); \
+#define HOOLIB_THROW(msg)                                \
+    {                                                    \
+        throw HooLib::Error((msg), __FILE__, __LINE__); \
     };
 #define HOOLIB_THROW_IF(ret, msg) \
     if ((ret)) {                  \
@@ -600,65 +626,141 @@ public:
     }
 };
 
-inline std::string cpp_escape_string(const std::string& src)
+namespace detail {
+// Calls f(it) for each it in [begin, end) pointing to one of Chars, in order.
+// f returns where to go on from, which lets it consume the chars after it.
+// The SIMD versions compare 16 or 32 bytes at a time and look only at the
+// bits set in the result, so runs of ordinary chars cost next to nothing.
+template <char... Chars, class F>
+void for_each_any_scalar(const char* begin, const char* end, F f)
+{
+    while (begin != end)
+        begin = ((*begin == Chars) || ...) ? f(begin) : begin + 1;
+}
+
+#ifdef __SSE2__
+template <char... Chars, class F>
+void for_each_any_sse2(const char* begin, const char* end, F f)
+{
+    const __m128i needles[] = {_mm_set1_epi8(Chars)...};
+    auto next = begin;
+    for (; end - begin >= 16; begin += 16) {
+        auto chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(begin));
+        auto hit = _mm_setzero_si128();
+        for (auto&& needle : needles)
+            hit = _mm_or_si128(hit, _mm_cmpeq_epi8(chunk, needle));
+        for (auto mask = _mm_movemask_epi8(hit); mask; mask &= mask - 1)
+            if (begin + __builtin_ctz(mask) >= next)
+                next = f(begin + __builtin_ctz(mask));
+    }
+    for_each_any_scalar<Chars...>(std::max(begin, next), end, f);
+}
+
+template <char... Chars, class F>
+__attribute__((target("avx2"))) void for_each_any_avx2(const char* begin,
+                                                       const char* end, F f)
+{
+    const __m256i needles[] = {_mm256_set1_epi8(Chars)...};
+    auto next = begin;
+    for (; end - begin >= 32; begin += 32) {
+        auto chunk =
+            _mm256_loadu_si256(reinterpret_cast<const __m256i*>(begin));
+        auto hit = _mm256_setzero_si256();
+        for (auto&& needle : needles)
+            hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(chunk, needle));
+        auto mask = static_cast<uint32_t>(_mm256_movemask_epi8(hit));
+        // -O0 doesn't clear the upper halves itself, which would slow down
+        // the SSE code f runs
+        _mm256_zeroupper();
+        for (; mask; mask &= mask - 1)
+            if (begin + __builtin_ctz(mask) >= next)
+                next = f(begin + __builtin_ctz(mask));
+    }
+    for_each_any_sse2<Chars...>(std::max(begin, next), end, f);
+}
+
+inline bool has_avx2()
 {
-    std::stringstream ss;
-    ss << "\"";
-    for (char ch : src) {
-        switch (ch) {
+    static const bool ret =
+        (__builtin_cpu_init(), __builtin_cpu_supports("avx2"));
+    return ret;
+}
+#endif
+
+template <char... Chars, class F>
+void for_each_any(const char* begin, const char* end, F f)
+{
+#ifdef __SSE2__
+    if (has_avx2()) return for_each_any_avx2<Chars...>(begin, end, f);
+    for_each_any_sse2<Chars...>(begin, end, f);
+#else
+    for_each_any_scalar<Chars...>(begin, end, f);
+#endif
+}
+}  // namespace detail
+
+// appends src escaped and quoted to out
+inline void cpp_escape_string(std::string& out, std::string_view src)
+{
+    out.reserve(out.size() + src.size() + 2);
+    out += '"';
+    auto run = src.data(), end = run + src.size();
+    detail::for_each_any<'\n', '\t', '\\', '"'>(run, end, [&](auto it) {
+        out.append(run, it - run);
+        switch (*it) {
             case '\n':
-                ss << "\\n";
+                out += "\\n";
                 break;
             case '\t':
-                ss << "\\t";
+                out += "\\t";
                 break;
             case '\\':
-                ss << "\\\\";
-                break;
-            case '\"':
-                ss << "\\\"";
+                out += "\\\\";
                 break;
-            default:
-                ss << ch;
+            case '"':
+                out += "\\\"";
                 break;
         }
-    }
-    ss << "\"";
-    return ss.str();
+        return run = it + 1;
+    });
+    out.append(run, end - run);
+    out += '"';
 }
 
-inline std::string cpp_unescape_string(const std::string& src)
+inline std::string cpp_escape_string(const std::string& src)
 {
-    bool backslashed = false;
     std::string ret;
-    for (size_t i = 1; i < src.size() - 1; i++) {
-        char ch = src[i];
-        if (backslashed) {
-            backslashed = false;
-            switch (ch) {
-                case 'n':
-                    ret.push_back('\n');
-                    break;
-                case '\\':
-                    ret.push_back('\\');
-                    break;
-                case '"':
-                    ret.push_back('"');
-                    break;
-                case 't':
-                    ret.push_back('\t');
-                    break;
-            }
-            continue;
-        }
+    cpp_escape_string(ret, src);
+    return ret;
+}
 
-        if (ch == '\\') {
-            backslashed = true;
-            continue;
+// src is quoted. Unknown escapes are dropped.
+inline std::string cpp_unescape_string(const std::string& src)
+{
+    std::string ret;
+    if (src.size() < 2) return ret;
+    ret.reserve(src.size() - 2);
+    auto run = src.data() + 1, end = src.data() + src.size() - 1;
+    detail::for_each_any<'\\'>(run, end, [&](auto it) {
+        ret.append(run, it - run);
+        if (end - it < 2) return run = end;
+        switch (it[1]) {
+            case 'n':
+                ret.push_back('\n');
+                break;
+            case '\\':
+                ret.push_back('\\');
+                break;
+            case '"':
+                ret.push_back('"');
+                break;
+            case 't':
+                ret.push_back('\t');
+                break;
         }
-
-        ret.push_back(ch);
-    }
+        return run = it + 2;
+    });
+    ret.append(run, end - run);
     return ret;
 }
 
@@ -0,0 +1,520 @@
+#include "jit.hpp"
+#include <cstring>
+#include <typeinfo>
+#include <vector>
+#include "factory.hpp"
+
+#if defined(__x86_64__)
+#include <sys/mman.h>
+#endif
+
+namespace mal::jit {
+namespace {
+MalTypePtr equal;  // = when the JIT was turned on
+size_t compiled_count = 0, bailout_count = 0;
+
+#if defined(__x86_64__)
+// Native calls using more of the C++ stack than this give up, and mal_eval
+// takes over with its own stack. Counted in bytes rather than calls, since
+// the frames grow with the parameters and let* bindings.
+constexpr size_t stack_budget = size_t(2) << 20;
+constexpr size_t max_params = 16;
+
+// shared with the machine code
+struct State {
+    uint64_t rsp;    // to return from anywhere when giving up
+    uint64_t floor;  // lowest rsp a call may start from
+    int64_t is_failed;
+};
+using Entry = int64_t (*)(const int64_t* args, State* state);
+
+class Assembler {
+public:
+    using Label = size_t;
+
+    // second bytes of 0F 8x jcc rel32
+    enum Cond : uint8_t {
+        O = 0x80,
+        B = 0x82,
+        E = 0x84,
+        NE = 0x85,
+        L = 0x8c,
+        GE = 0x8d,
+        LE = 0x8e,
+        G = 0x8f
+    };
+
+private:
+    std::vector<uint8_t> code_;
+    std::vector<size_t> labels_;
+    std::vector<std::pair<size_t, Label>> fixups_;  // rel32 to label
+
+public:
+    size_t size() const { return code_.size(); }
+
+    void emit(std::initializer_list<uint8_t> bytes)
+    {
+        code_.insert(code_.end(), bytes);
+    }
+    void imm32(int32_t value)
+    {
+        auto p = reinterpret_cast<const uint8_t*>(&value);
+        code_.insert(code_.end(), p, p + sizeof(value));
+    }
+    void imm64(int64_t value)
+    {
+        auto p = reinterpret_cast<const uint8_t*>(&value);
+        code_.insert(code_.end(), p, p + sizeof(value));
+    }
+    void patch32(size_t pos, int32_t value)
+    {
+        std::memcpy(code_.data() + pos, &value, sizeof(value));
+    }
+
+    Label label()
+    {
+        labels_.push_back(SIZE_MAX);
+        return labels_.size() - 1;
+    }
+    void bind(Label label) { labels_[label] = code_.size(); }
+    void rel32(Label label)
+    {
+        fixups_.emplace_back(code_.size(), label);
+        imm32(0);
+    }
+
+    void jmp(Label label)
+    {
+        emit({0xe9});
+        rel32(label);
+    }
+    void jcc(Cond cond, Label label)
+    {
+        emit({0x0f, cond});
+        rel32(label);
+    }
+    void call(Label label)
+    {
+        emit({0xe8});
+        rel32(label);
+    }
+
+    const std::vector<uint8_t>& finish()
+    {
+        for (auto && [ pos, label ] : fixups_)
+            patch32(pos, static_cast<int32_t>(labels_[label] - (pos + 4)));
+        return code_;
+    }
+};
+
+// Translates the body of a closure. Each expression leaves its value in
+// rax, with the operands of binary operations pushed meanwhile. The body is
+// a function of its own, taking the arguments on the stack, so that it can
+// call itself. r12 points to State and r13 holds its floor.
+class Translator {
+private:
+    using Label = Assembler::Label;
+
+    Assembler as_;
+    const MalClosure& closure_;
+    size_t nparams_;
+    // let* bindings in scope, innermost last, and their offsets from rbp
+    std::vector<std::pair<std::string, int32_t>> locals_;
+    int32_t nslots_ = 0;
+    Label body_, start_, bail_;
+    std::vector<std::pair<std::string, MalTypePtr>>& globals_;
+
+    int32_t param_offset(size_t index) const
+    {
+        return static_cast<int32_t>(16 + 8 * (nparams_ - 1 - index));
+    }
+
+    void load(int32_t offset)  // mov rax, [rbp+offset]
+    {
+        as_.emit({0x48, 0x8b, 0x85});
+        as_.imm32(offset);
+    }
+    void store(int32_t offset)  // mov [rbp+offset], rax
+    {
+        as_.emit({0x48, 0x89, 0x85});
+        as_.imm32(offset);
+    }
+    void immediate(int64_t value)  // mov rax, imm64
+    {
+        as_.emit({0x48, 0xb8});
+        as_.imm64(value);
+    }
+    void push() { as_.emit({0x50}); }  // push rax
+
+    // the offset of a parameter or let* binding, or nullptr
+    const int32_t* local(const std::string& name)
+    {
+        for (auto it = locals_.rbegin(); it != locals_.rend(); ++it)
+            if (it->first == name) return &it->second;
+        return nullptr;
+    }
+
+    // the global name refers to, which the code depends on from now on
+    MalTypePtr global(const std::string& name)
+    {
+        auto value = closure_.env()->get_if(name);
+        HOOLIB_THROW_UNLESS(value, "unsupported");
+        globals_.emplace_back(name, value);
+        return value;
+    }
+
+    // the callee ast calls, if it's a global
+    MalTypePtr callee(const MalTypePtr& ast)
+    {
+        auto list = ast->as_list();
+        if (!list || list->get().empty()) return nullptr;
+        auto symbol = list->get()[0]->as_symbol();
+        if (!symbol || local(symbol->name())) return nullptr;
+        return global(symbol->name());
+    }
+
+    // rax = lhs, rcx = rhs
+    void operands(const MalTypePtr& lhs, const MalTypePtr& rhs)
+    {
+        expr(rhs, false);
+        push();
+        expr(lhs, false);
+        as_.emit({0x59});  // pop rcx
+    }
+
+    void arithmetic(MalArithmetic::Op op, const std::vector<MalTypePtr>& args)
+    {
+        using Op = MalArithmetic::Op;
+        HOOLIB_THROW_UNLESS(op <= Op::DIV, "unsupported");
+        if (args.size() == 1) {
+            if (op == Op::ADD || op == Op::MUL) return expr(args[0], false);
+            if (op == Op::SUB) {  // neg rax
+                expr(args[0], false);
+                as_.emit({0x48, 0xf7, 0xd8});
+                as_.jcc(Assembler::O, bail_);
+                return;
+            }
+        }
+        HOOLIB_THROW_UNLESS(args.size() >= 2, "unsupported");
+
+        expr(args[0], false);
+        for (size_t i = 1; i < args.size(); i++) {
+            push();
+            expr(args[i], false);
+            as_.emit({0x48, 0x89, 0xc1});  // mov rcx, rax
+            as_.emit({0x58});              // pop rax
+            switch (op) {
+                case Op::ADD:
+                    as_.emit({0x48, 0x01, 0xc8});  // add rax, rcx
+                    break;
+                case Op::SUB:
+                    as_.emit({0x48, 0x29, 0xc8});  // sub rax, rcx
+                    break;
+                case Op::MUL:
+                    as_.emit({0x48, 0x0f, 0xaf, 0xc1});  // imul rax, rcx
+                    break;
+                default:
+                    // Division by 0 and INT64_MIN / -1 are left to mal_eval.
+                    as_.emit({0x48, 0x85, 0xc9});  // test rcx, rcx
+                    as_.jcc(Assembler::E, bail_);
+                    as_.emit({0x48, 0x83, 0xf9, 0xff});  // cmp rcx, -1
+                    as_.jcc(Assembler::E, bail_);
+                    as_.emit({0x48, 0x99});        // cqo
+                    as_.emit({0x48, 0xf7, 0xf9});  // idiv rcx
+                    continue;
+            }
+            as_.jcc(Assembler::O, bail_);
+        }
+    }
+
+    void call_self(const std::vector<MalTypePtr>& args, bool tail)
+    {
+        HOOLIB_THROW_UNLESS(args.size() == nparams_, "unsupported");
+        for (auto&& arg : args) {
+            expr(arg, false);
+            push();
+        }
+        if (tail) {  // rebind the parameters and start over
+            for (size_t i = nparams_; i-- > 0;) {
+                as_.emit({0x58});  // pop rax
+                store(param_offset(i));
+            }
+            as_.jmp(start_);
+            return;
+        }
+        as_.emit({0x4c, 0x39, 0xec});  // cmp rsp, r13
+        as_.jcc(Assembler::B, bail_);
+        as_.call(body_);
+        if (nparams_ > 0) {  // add rsp, 8 * nparams
+            as_.emit({0x48, 0x81, 0xc4});
+            as_.imm32(static_cast<int32_t>(8 * nparams_));
+        }
+    }
+
+    // jumps to if_false unless ast is truthy. Integers always are.
+    void test(const MalTypePtr& ast, Label if_false)
+    {
+        if (ast->as_nil() || ast->as_false()) return as_.jmp(if_false);
+        if (ast->as_true() || ast->as_string()) return;
+
+        auto func = callee(ast);
+        const auto& args = ast->as_list() ? ast->as_list()->get()
+                                          : std::vector<MalTypePtr>();
+        auto arithmetic = dynamic_cast<const MalArithmetic*>(func.get());
+        bool is_comparison =
+            (arithmetic && arithmetic->op() >= MalArithmetic::Op::LT) ||
+            (func && func == equal);
+        if (!is_comparison) return expr(ast, false);
+
+        HOOLIB_THROW_UNLESS(args.size() == 3, "unsupported");
+        operands(args[1], args[2]);
+        as_.emit({0x48, 0x39, 0xc8});  // cmp rax, rcx
+        auto negated = Assembler::NE;
+        if (arithmetic) {
+            switch (arithmetic->op()) {
+                case MalArithmetic::Op::LT:
+                    negated = Assembler::GE;
+                    break;
+                case MalArithmetic::Op::LE:
+                    negated = Assembler::G;
+                    break;
+                case MalArithmetic::Op::GT:
+                    negated = Assembler::LE;
+                    break;
+                default:
+                    negated = Assembler::L;
+                    break;
+            }
+        }
+        as_.jcc(negated, if_false);
+    }
+
+    void expr(const MalTypePtr& ast, bool tail)
+    {
+        if (typeid(*ast) == typeid(MalInteger))
+            return immediate(static_cast<const MalInteger&>(*ast).get());
+
+        if (auto symbol = ast->as_symbol()) {
+            if (auto offset = local(symbol->name())) return load(*offset);
+            auto value = global(symbol->name());
+            HOOLIB_THROW_UNLESS(typeid(*value) == typeid(MalInteger),
+                                "unsupported");
+            return immediate(static_cast<const MalInteger&>(*value).get());
+        }
+
+        auto list = ast->as_list();
+        HOOLIB_THROW_UNLESS(list && !list->get().empty(), "unsupported");
+        const auto& items = list->get();
+        auto symbol = items[0]->as_symbol();
+        HOOLIB_THROW_UNLESS(symbol, "unsupported");
+        const auto& name = symbol->name();
+
+        if (name == "if") {
+            // Without else, it may be nil.
+            HOOLIB_THROW_UNLESS(items.size() == 4, "unsupported");
+            auto else_ = as_.label(), end = as_.label();
+            test(items[1], else_);
+            expr(items[2], tail);
+            as_.jmp(end);
+            as_.bind(else_);
+            expr(items[3], tail);
+            as_.bind(end);
+            return;
+        }
+
+        if (name == "let*") {
+            HOOLIB_THROW_UNLESS(items.size() == 3, "unsupported");
+            auto bindings_src = items[1]->as_sequential();
+            HOOLIB_THROW_UNLESS(bindings_src, "unsupported");
+            const auto& bindings = bindings_src->get();
+            HOOLIB_THROW_UNLESS(bindings.size() % 2 == 0, "unsupported");
+            auto depth = locals_.size();
+            for (size_t i = 0; i < bindings.size(); i += 2) {
+                auto binding = bindings[i]->as_symbol();
+                HOOLIB_THROW_UNLESS(binding, "unsupported");
+                expr(bindings[i + 1], false);
+                int32_t offset = -8 * ++nslots_;
+                store(offset);
+                locals_.emplace_back(binding->name(), offset);
+            }
+            expr(items[2], tail);
+            locals_.resize(depth);
+            return;
+        }
+
+        auto func = callee(ast);
+        HOOLIB_THROW_UNLESS(func, "unsupported");
+        std::vector<MalTypePtr> args(items.begin() + 1, items.end());
+        if (func.get() == &closure_) return call_self(args, tail);
+        if (typeid(*func) == typeid(MalArithmetic))
+            return arithmetic(static_cast<const MalArithmetic&>(*func).op(),
+                              args);
+        HOOLIB_THROW_UNLESS(false, "unsupported");
+    }
+
+public:
+    Translator(const MalClosure& closure,
+               std::vector<std::pair<std::string, MalTypePtr>>& globals)
+        : closure_(closure),
+          nparams_(closure.params().size()),
+          body_(as_.label()),
+          start_(as_.label()),
+          bail_(as_.label()),
+          globals_(globals)
+    {
+        for (size_t i = 0; i < nparams_; i++)
+            locals_.emplace_back(closure.params()[i], param_offset(i));
+    }
+
+    const std::vector<uint8_t>& translate()
+    {
+        // int64_t entry(const int64_t* args, State* state)
+        as_.emit({0x53, 0x55, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41,
+                  0x57});                          // push rbx, rbp, r12-r15
+        as_.emit({0x49, 0x89, 0xf4});              // mov r12, rsi
+        as_.emit({0x49, 0x89, 0x24, 0x24});        // mov [r12], rsp
+        as_.emit({0x4d, 0x8b, 0x6c, 0x24, 0x08});  // mov r13, [r12+8]
+        for (size_t i = 0; i < nparams_; i++) {    // push [rdi+8*i]
+            as_.emit({0xff, 0xb7});
+            as_.imm32(static_cast<int32_t>(8 * i));
+        }
+        as_.call(body_);
+        if (nparams_ > 0) {  // add rsp, 8 * nparams
+            as_.emit({0x48, 0x81, 0xc4});
+            as_.imm32(static_cast<int32_t>(8 * nparams_));
+        }
+        auto epilogue = as_.label();
+        as_.bind(epilogue);
+        as_.emit({0x41, 0x5f, 0x41, 0x5e, 0x41, 0x5d, 0x41, 0x5c, 0x5d,
+                  0x5b});  // pop r15-r12, rbp, rbx
+        as_.emit({0xc3});  // ret
+        as_.bind(bail_);
+        as_.emit({0x49, 0x8b, 0x24, 0x24});  // mov rsp, [r12]
+        as_.emit({0x49, 0xc7, 0x44, 0x24, 0x10});  // mov qword [r12+16], 1
+        as_.imm32(1);
+        as_.jmp(epilogue);
+
+        as_.bind(body_);
+        as_.emit({0x55});              // push rbp
+        as_.emit({0x48, 0x89, 0xe5});  // mov rbp, rsp
+        as_.emit({0x48, 0x81, 0xec});  // sub rsp, 8 * nslots
+        auto frame_size = as_.size();
+        as_.imm32(0);
+        as_.bind(start_);
+        expr(closure_.body(), true);
+        as_.emit({0x48, 0x89, 0xec});  // mov rsp, rbp
+        as_.emit({0x5d, 0xc3});        // pop rbp, ret
+        as_.patch32(frame_size, 8 * nslots_);
+        return as_.finish();
+    }
+};
+
+class Native : public MalFunction {
+private:
+    MalClosure& closure_;
+    void* memory_;
+    size_t size_;
+    // the globals the code has taken in, checked again when one of the
+    // globals is redefined
+    std::vector<std::pair<std::string, MalTypePtr>> globals_;
+    uint64_t generation_;
+
+    bool is_valid()
+    {
+        if (generation_ == Env::generation()) return true;
+        for (auto && [ name, value ] : globals_)
+            if (closure_.env()->get_if(name) != value) return false;
+        generation_ = Env::generation();
+        return true;
+    }
+
+    bool is_fixnums(const Args& args) const
+    {
+        if (args.size() != closure_.params().size()) return false;
+        for (auto&& arg : args)
+            if (typeid(*arg) != typeid(MalInteger)) return false;
+        return true;
+    }
+
+public:
+    Native(MalClosure& closure, void* memory, size_t size,
+           std::vector<std::pair<std::string, MalTypePtr>> globals)
+        : closure_(closure),
+          memory_(memory),
+          size_(size),
+          globals_(std::move(globals)),
+          generation_(Env::generation())
+    {
+    }
+
+    ~Native() { munmap(memory_, size_); }
+
+    // The arguments are checked before entering the code. Calls with
+    // anything but integers are left to the caller.
+    MalTypePtr try_callN(const Args& args) override
+    {
+        if (!is_valid()) {
+            bailout_count++;
+            closure_.drop_tiered();
+            return nullptr;
+        }
+        if (!is_fixnums(args)) return nullptr;
+        int64_t argv[max_params];
+        for (size_t i = 0; i < args.size(); i++)
+            argv[i] = static_cast<const MalInteger&>(*args[i]).get();
+        State state{0, reinterpret_cast<uint64_t>(&state) - stack_budget, 0};
+        auto result = reinterpret_cast<Entry>(memory_)(argv, &state);
+        if (!state.is_failed) return mal::int_(result);
+        // Overflow, division by 0 or deep recursion, which mal_eval takes
+        // care of from now on.
+        bailout_count++;
+        closure_.drop_tiered();
+        return nullptr;
+    }
+
+    MalTypePtr callN(const Args& args) override
+    {
+        if (auto value = try_callN(args)) return value;
+        return mal_eval(closure_.body(), closure_.make_env(args));
+    }
+};
+#endif
+}  // namespace
+
+void set_enabled(const EnvPtr& env) { equal = env ? env->get_if("=") : nullptr; }
+
+std::shared_ptr<MalFunction> compile(const std::shared_ptr<MalClosure>& closure)
+{
+#if defined(__x86_64__)
+    // Only the closures defined at top level, whose globals are known
+    if (!equal || closure->is_variadic() || closure->env()->outer() ||
+        closure->params().size() > max_params)
+        return nullptr;
+
+    std::vector<std::pair<std::string, MalTypePtr>> globals;
+    std::vector<uint8_t> code;
+    try {
+        code = Translator(*closure, globals).translate();
+    }
+    catch (std::runtime_error&) {
+        return nullptr;
+    }
+
+    void* memory = mmap(nullptr, code.size(), PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) return nullptr;
+    std::memcpy(memory, code.data(), code.size());
+    if (mprotect(memory, code.size(), PROT_READ | PROT_EXEC) != 0) {
+        munmap(memory, code.size());
+        return nullptr;
+    }
+    compiled_count++;
+    return mal::make_shared<Native>(*closure, memory, code.size(),
+                                    std::move(globals));
+#else
+    return nullptr;
+#endif
+}
+
+Stats stats() { return Stats{compiled_count, bailout_count}; }
+}  // namespace mal::jit
@@ -0,0 +1,28 @@
+#pragma once
+#ifndef MAL_JIT_HPP
+#define MAL_JIT_HPP
+
+#include "env.hpp"
+
+// Template JIT for x86-64. A hot closure of mal_eval whose body uses nothing
+// but integers, + - * /, comparisons, if, let* and calls to itself is
+// translated into machine code, which works on raw 64-bit integers. Calls
+// with anything but integers, and the code giving up on overflow, division
+// by 0 or deep recursion, go back to mal_eval. See vm::set_tiering for when
+// a closure is hot.
+namespace mal::jit {
+// env is where the builtins the code may call, such as =, are found. nullptr
+// turns it off.
+void set_enabled(const EnvPtr& env);
+
+// machine code for closure, or nullptr if it's off or can't translate it
+std::shared_ptr<MalFunction> compile(const std::shared_ptr<MalClosure>& closure);
+
+struct Stats {
+    size_t compiled;
+    size_t bailouts;  // went back to mal_eval
+};
+Stats stats();
+}  // namespace mal::jit
+
+#endif
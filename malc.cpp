@@ -0,0 +1,700 @@
+#include <cctype>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "malc.hpp"
+#include "reader.hpp"
+
+// malc compiles a mal program into C++ ahead of time:
+//   ./malc prog.mal -o prog.cpp
+//   g++ -std=c++17 prog.cpp malc_core.cpp core.cpp reader.cpp type.cpp env.cpp
+// or just `make prog.malc`. Macros are expanded at compile time by
+// macroexpand. For that, defmacro! and (def! name (fn* ...)) at top level
+// are evaluated beforehand as well as compiled, and (load-file "...") at top
+// level is compiled in place. Each fn* becomes a C++ lambda keeping its
+// locals in C++ variables. recur and a tail call of a global function to
+// itself jump back instead of calling. Like the VM, def! always defines a
+// global.
+
+namespace {
+// a C++ string literal of str, which may have the 0xff of keywords
+std::string literal(const std::string& str)
+{
+    std::stringstream ss;
+    ss << "\"";
+    for (unsigned char ch : str) {
+        switch (ch) {
+            case '\n':
+                ss << "\\n";
+                break;
+            case '\\':
+                ss << "\\\\";
+                break;
+            case '\"':
+                ss << "\\\"";
+                break;
+            default:
+                if (ch < 0x20 || ch >= 0x7f) {
+                    char buf[8];
+                    std::snprintf(buf, sizeof(buf), "\\%03o", ch);
+                    ss << buf;
+                }
+                else {
+                    ss << ch;
+                }
+                break;
+        }
+    }
+    ss << "\"";
+    return ss.str();
+}
+
+// part of a C++ identifier made from a mal name
+std::string mangle(const std::string& name)
+{
+    std::string ret;
+    for (unsigned char ch : name)
+        ret += std::isalnum(ch) ? static_cast<char>(ch) : '_';
+    return ret;
+}
+
+const MalSymbol* head_symbol(const MalTypePtr& ast)
+{
+    auto list = ast->as_list();
+    if (!list || list->get().empty()) return nullptr;
+    return dynamic_cast<const MalSymbol*>(list->get()[0].get());
+}
+
+bool is_form(const MalTypePtr& ast, const std::string& name)
+{
+    auto symbol = head_symbol(ast);
+    return symbol && symbol->name() == name;
+}
+
+// whether a fn* in ast refers to name
+bool is_captured(const MalTypePtr& ast, const std::string& name,
+                 bool in_fn = false)
+{
+    if (auto symbol = ast->as_symbol()) return in_fn && symbol->name() == name;
+    if (auto hash = ast->as_hash_map()) {
+        for (auto && [ key, value ] : hash->data())
+            if (is_captured(value, name, in_fn)) return true;
+        return false;
+    }
+    auto seq = ast->as_sequential();
+    if (!seq) return false;
+    if (is_form(ast, "quote")) return false;
+    in_fn = in_fn || is_form(ast, "fn*");
+    for (auto&& item : seq->get())
+        if (is_captured(item, name, in_fn)) return true;
+    return false;
+}
+
+class Compiler {
+private:
+    // where recur jumps to
+    struct Loop {
+        std::string label;
+        std::vector<std::string> vars;
+        bool is_used = false;
+    };
+
+    // where a tail call of the function to itself jumps to
+    struct Self {
+        std::string name, label;
+        std::vector<std::string> params;
+        bool is_used = false;
+    };
+
+    // where the value of a form goes. loop and self are set while the form
+    // is in tail position of them.
+    struct Context {
+        enum class Kind { RETURN, ASSIGN, DISCARD } kind;
+        std::string var;  // of ASSIGN
+        Loop* loop = nullptr;
+        Self* self = nullptr;
+    };
+
+    static Context assign(const std::string& var)
+    {
+        return {Context::Kind::ASSIGN, var};
+    }
+    static Context discard() { return {Context::Kind::DISCARD, ""}; }
+
+    EnvPtr env_;
+    std::stringstream header_, main_;
+    std::ostream* out_ = &main_;
+    int indent_ = 2, next_id_ = 0;
+    std::unordered_map<std::string, std::string> globals_, constants_;
+    // the locals in scope and their C++ expressions, innermost last. A box
+    // of let* not bound yet is seen only from a fn* made after it.
+    struct Local {
+        std::string name, expr;
+        bool is_bound = true;
+    };
+    std::vector<Local> locals_;
+    size_t fn_start_ = 0;  // size of locals_ at the innermost fn*
+
+    void line(const std::string& src)
+    {
+        *out_ << std::string(indent_ * 4, ' ') << src << "\n";
+    }
+    void open(const std::string& src)
+    {
+        line(src);
+        indent_++;
+    }
+    void close(const std::string& src = "}")
+    {
+        indent_--;
+        line(src);
+    }
+
+    std::string id(const std::string& prefix, const std::string& name = "")
+    {
+        auto ret = prefix + std::to_string(next_id_++);
+        if (!name.empty()) ret += "_" + mangle(name);
+        return ret;
+    }
+
+    std::string temp()
+    {
+        auto var = id("t");
+        line("MalTypePtr " + var + ";");
+        return var;
+    }
+
+    std::string global(const std::string& name)
+    {
+        auto it = globals_.find(name);
+        if (it != globals_.end()) return it->second;
+        auto var = id("g", name);
+        header_ << "malc::Global " << var << "(" << literal(name) << ");\n";
+        return globals_[name] = var;
+    }
+
+    std::string constant(const MalTypePtr& ast)
+    {
+        HOOLIB_THROW_UNLESS(!ast->as_function() && !ast->as_atom(),
+                            "can't compile " + ast->pr_str(true));
+        auto src = ast->pr_str(true);
+        auto it = constants_.find(src);
+        if (it != constants_.end()) return it->second;
+        auto var = id("k");
+        header_ << "const MalTypePtr " << var << " = malc::constant("
+                << literal(src) << ");\n";
+        return constants_[src] = var;
+    }
+
+    const std::string* local(const std::string& name) const
+    {
+        for (size_t i = locals_.size(); i-- > 0;)
+            if (locals_[i].name == name &&
+                (locals_[i].is_bound || i < fn_start_))
+                return &locals_[i].expr;
+        return nullptr;
+    }
+
+    static bool is_simple(const MalTypePtr& ast)
+    {
+        auto list = ast->as_list();
+        return ast->as_symbol() || ast->as_integer() || ast->as_string() ||
+               ast->as_nil() || ast->as_true() || ast->as_false() ||
+               (list && list->get().empty());
+    }
+
+    // C++ expression of ast, computed into a temporary unless it's simple
+    std::string value(const MalTypePtr& ast)
+    {
+        if (auto symbol = ast->as_symbol()) {
+            if (auto var = local(symbol->name())) return *var;
+            return global(symbol->name()) + ".get()";
+        }
+        if (ast->as_nil()) return "mal::nil()";
+        if (ast->as_true()) return "mal::true_()";
+        if (ast->as_false()) return "mal::false_()";
+        if (is_simple(ast)) return constant(ast);
+        auto var = temp();
+        compile(ast, assign(var));
+        return var;
+    }
+
+    // is_pure is whether expr can be dropped when the value is discarded
+    void deliver(const Context& ctx, const std::string& expr,
+                 bool is_pure = false)
+    {
+        switch (ctx.kind) {
+            case Context::Kind::RETURN:
+                line("return " + expr + ";");
+                break;
+            case Context::Kind::ASSIGN:
+                line(ctx.var + " = " + expr + ";");
+                break;
+            case Context::Kind::DISCARD:
+                if (!is_pure) line(expr + ";");
+                break;
+        }
+    }
+
+    // assigns values to vars all at once and jumps to label
+    void jump(const std::vector<std::string>& vars,
+              const std::vector<std::string>& values, const std::string& label)
+    {
+        std::vector<std::string> temps;
+        for (auto&& value : values) {
+            temps.push_back(id("t"));
+            line("MalTypePtr " + temps.back() + " = " + value + ";");
+        }
+        for (size_t i = 0; i < vars.size(); i++)
+            line(vars[i] + " = std::move(" + temps[i] + ");");
+        line("goto " + label + ";");
+    }
+
+    // compiles into a separate stream, so that what comes before can be
+    // decided afterwards
+    template <class F>
+    std::string aside(F f)
+    {
+        std::stringstream ss;
+        auto out = out_;
+        out_ = &ss;
+        f();
+        out_ = out;
+        return ss.str();
+    }
+
+    void compile_call(const std::vector<MalTypePtr>& items, const Context& ctx)
+    {
+        std::vector<std::string> values;
+        for (auto&& item : items) values.push_back(value(item));
+        std::string args;
+        for (auto&& value : values) args += (args.empty() ? "" : ", ") + value;
+
+        auto symbol = items[0]->as_symbol();
+        if (ctx.self && symbol && symbol->name() == ctx.self->name &&
+            !local(symbol->name()) &&
+            items.size() - 1 == ctx.self->params.size()) {
+            ctx.self->is_used = true;
+            open("if (&malc::callee(" + values[0] + ") == &self) {");
+            jump(ctx.self->params,
+                 std::vector<std::string>(values.begin() + 1, values.end()),
+                 ctx.self->label);
+            close();
+        }
+        deliver(ctx, "malc::call(" + args + ")");
+    }
+
+    // self is the name the function is defined as by def!, if any
+    void compile_fn(const std::vector<MalTypePtr>& args, const Context& ctx,
+                    const std::string& self_name = "")
+    {
+        HOOLIB_THROW_UNLESS(args.size() == 3, "invalid number of argument");
+        auto params_src = args[1]->as_sequential();
+        HOOLIB_THROW_UNLESS(params_src, "invalid argument");
+        std::vector<std::string> params;
+        bool variadic = false;
+        for (auto&& param : params_src->get()) {
+            auto symbol = param->as_symbol();
+            HOOLIB_THROW_UNLESS(symbol, "invalid argument");
+            if (symbol->name() == "&")
+                variadic = true;
+            else
+                params.push_back(symbol->name());
+        }
+        size_t nfixed = params.size() - (variadic ? 1 : 0);
+
+        auto var = id("f");
+        open("auto " + var +
+             " = malc::function([=](MalFunction& self, const "
+             "MalFunction::Args& args) -> MalTypePtr {");
+        line("malc::check_arity(args, " + std::to_string(nfixed) + ", " +
+             (variadic ? "true" : "false") + ");");
+        auto depth = locals_.size(), fn_start = fn_start_;
+        fn_start_ = depth;
+        Self self{self_name, id("self")};
+        for (size_t i = 0; i < params.size(); i++) {
+            auto param = id("v", params[i]);
+            line("MalTypePtr " + param + " = " +
+                 (i < nfixed ? "args[" + std::to_string(i) + "]"
+                             : "malc::rest(args, " + std::to_string(nfixed) +
+                                   ")") +
+                 ";");
+            locals_.push_back({params[i], param});
+            self.params.push_back(param);
+        }
+        Context body_ctx{Context::Kind::RETURN, ""};
+        if (!self_name.empty() && !variadic) body_ctx.self = &self;
+        auto body = aside([&] { compile(args[2], body_ctx); });
+        if (self.is_used) line(self.label + ":;");
+        *out_ << body;
+        locals_.resize(depth);
+        fn_start_ = fn_start;
+        close("});");
+        deliver(ctx, var, true);
+    }
+
+    // let* and loop*. loop is set for loop*.
+    void compile_let(const std::vector<MalTypePtr>& args, const Context& ctx,
+                     bool is_loop)
+    {
+        HOOLIB_THROW_UNLESS(args.size() == 3, "invalid number of argument");
+        auto bindings_src = args[1]->as_sequential();
+        HOOLIB_THROW_UNLESS(bindings_src, "invalid argument");
+        const auto& bindings = bindings_src->get();
+        HOOLIB_THROW_UNLESS(bindings.size() % 2 == 0, "invalid argument");
+
+        open("{");
+        auto depth = locals_.size();
+        // A binding a fn* refers to is boxed, so that the function sees the
+        // value bound later. The box is in scope from the start for fn*s and
+        // from its own binding for the rest.
+        std::unordered_map<std::string, size_t> boxed;  // into locals_
+        for (size_t i = 0; !is_loop && i < bindings.size(); i += 2) {
+            auto symbol = bindings[i]->as_symbol();
+            HOOLIB_THROW_UNLESS(symbol, "invalid argument");
+            for (size_t j = 1; j <= i + 1; j += 2) {
+                if (is_captured(bindings[j], symbol->name())) {
+                    auto box = id("b", symbol->name());
+                    line("auto " + box + " = std::make_shared<MalTypePtr>();");
+                    boxed.emplace(symbol->name(), locals_.size());
+                    locals_.push_back({symbol->name(), "(*" + box + ")", false});
+                    break;
+                }
+            }
+        }
+        Loop loop{id("loop")};
+        for (size_t i = 0; i < bindings.size(); i += 2) {
+            auto symbol = bindings[i]->as_symbol();
+            HOOLIB_THROW_UNLESS(symbol, "invalid argument");
+            const auto& name = symbol->name();
+            auto it = boxed.find(name);
+            if (it != boxed.end()) {
+                compile(bindings[i + 1], assign(locals_[it->second].expr));
+                locals_[it->second].is_bound = true;
+                continue;
+            }
+            auto var = id("v", name);
+            line("MalTypePtr " + var + ";");
+            compile(bindings[i + 1], assign(var));
+            locals_.push_back({name, var});
+            loop.vars.push_back(var);
+        }
+        if (is_loop) {
+            auto body_ctx = ctx;
+            body_ctx.loop = &loop;
+            auto body = aside([&] { compile(args[2], body_ctx); });
+            if (loop.is_used) line(loop.label + ":;");
+            *out_ << body;
+        }
+        else {
+            compile(args[2], ctx);
+        }
+        locals_.resize(depth);
+        close();
+    }
+
+    void compile_if(const MalTypePtr& cond, const MalTypePtr& then,
+                    const MalTypePtr& else_, const Context& ctx,
+                    bool negate = false)
+    {
+        open(std::string("if (") + (negate ? "!" : "") + "malc::is_true(" +
+             value(cond) + ")) {");
+        compile(then, ctx);
+        close();
+        open("else {");
+        compile(else_, ctx);
+        close();
+    }
+
+    void compile_cond(const std::vector<MalTypePtr>& args, size_t i,
+                      const Context& ctx)
+    {
+        if (i == args.size()) return compile(mal::nil(), ctx);
+        if (i + 1 == args.size())
+            MAL_THROW_STRING("odd number of forms to cond");
+        open("{");
+        open("if (malc::is_true(" + value(args[i]) + ")) {");
+        compile(args[i + 1], ctx);
+        close();
+        open("else {");
+        compile_cond(args, i + 2, ctx);
+        close();
+        close();
+    }
+
+    void compile_and_or(const std::vector<MalTypePtr>& args, size_t i,
+                        const Context& ctx, bool is_and)
+    {
+        if (i + 1 == args.size()) return compile(args[i], ctx);
+        open("{");
+        auto var = value(args[i]);
+        open(std::string("if (") + (is_and ? "" : "!") + "malc::is_true(" +
+             var + ")) {");
+        compile_and_or(args, i + 1, ctx, is_and);
+        close();
+        open("else {");
+        deliver(ctx, var, true);
+        close();
+        close();
+    }
+
+    MalTypePtr do_form(const std::vector<MalTypePtr>& args, size_t begin)
+    {
+        std::vector<MalTypePtr> items = {mal::symbol("do")};
+        items.insert(items.end(), args.begin() + begin, args.end());
+        return mal::list(items);
+    }
+
+    void compile_try(const std::vector<MalTypePtr>& args, const Context& ctx)
+    {
+        HOOLIB_THROW_UNLESS(args.size() == 3, "invalid number of arguments");
+        auto catch_list = args[2]->as_list();
+        HOOLIB_THROW_UNLESS(catch_list && catch_list->get().size() == 3 &&
+                                is_form(args[2], "catch*"),
+                            "invalid argument");
+        auto symbol = catch_list->get()[1]->as_symbol();
+        HOOLIB_THROW_UNLESS(symbol, "invalid argument");
+
+        auto var = temp();
+        open("try {");
+        compile(args[1], assign(var));
+        close();
+        open("catch (mal::Exception& ex) {");
+        auto bound = id("v", symbol->name());
+        line("MalTypePtr " + bound + " = ex.get();");
+        locals_.push_back({symbol->name(), bound});
+        compile(catch_list->get()[2], assign(var));
+        locals_.pop_back();
+        close();
+        deliver(ctx, var, true);
+    }
+
+    // def! and defmacro!
+    void compile_def(const std::vector<MalTypePtr>& args, const Context& ctx,
+                     bool is_macro)
+    {
+        HOOLIB_THROW_UNLESS(args.size() == 3, "invalid number of argument");
+        auto symbol = args[1]->as_symbol();
+        HOOLIB_THROW_UNLESS(symbol, "invalid argument");
+        std::string var;
+        if (is_form(args[2], "fn*")) {
+            var = temp();
+            compile_fn(args[2]->as_list()->get(), assign(var), symbol->name());
+        }
+        else {
+            var = value(args[2]);
+        }
+        if (is_macro) line("malc::callee(" + var + ").set_macro();");
+        line(global(symbol->name()) + ".set(" + var + ");");
+        deliver(ctx, var, true);
+    }
+
+    // special forms; false if the list isn't one of them
+    bool compile_special(const std::string& name, const MalList& list,
+                         const Context& ctx)
+    {
+        const auto& args = list.get();
+
+        if (name == "def!" || name == "defmacro!")
+            compile_def(args, ctx, name == "defmacro!");
+        else if (name == "let*" || name == "loop*")
+            compile_let(args, ctx, name == "loop*");
+        else if (name == "recur") {
+            HOOLIB_THROW_UNLESS(ctx.loop, "recur not in tail position");
+            HOOLIB_THROW_UNLESS(args.size() - 1 == ctx.loop->vars.size(),
+                                "invalid number of arguments");
+            ctx.loop->is_used = true;
+            std::vector<std::string> values;
+            for (size_t i = 1; i < args.size(); i++)
+                values.push_back(value(args[i]));
+            jump(ctx.loop->vars, values, ctx.loop->label);
+        }
+        else if (name == "do") {
+            for (size_t i = 1; i + 1 < args.size(); i++)
+                compile(args[i], discard());
+            compile(args.size() == 1 ? mal::nil() : args.back(), ctx);
+        }
+        else if (name == "if") {
+            HOOLIB_THROW_UNLESS(args.size() == 3 || args.size() == 4,
+                                "invalid argument");
+            compile_if(args[1], args[2],
+                       args.size() == 4 ? args[3] : mal::nil(), ctx);
+        }
+        else if (name == "cond")
+            compile_cond(args, 1, ctx);
+        else if (name == "and" || name == "or") {
+            if (args.size() == 1)
+                compile(name == "and" ? MalTypePtr(mal::true_()) : mal::nil(),
+                        ctx);
+            else
+                compile_and_or(args, 1, ctx, name == "and");
+        }
+        else if (name == "when" || name == "when-not") {
+            HOOLIB_THROW_UNLESS(args.size() >= 2,
+                                "invalid number of arguments");
+            compile_if(args[1], do_form(args, 2), mal::nil(), ctx,
+                       name == "when-not");
+        }
+        else if (name == "->" || name == "->>")
+            compile(list.threaded(), ctx);
+        else if (name == "fn*")
+            compile_fn(args, ctx);
+        else if (name == "quote") {
+            HOOLIB_THROW_UNLESS(args.size() == 2,
+                                "invalid number of arguments");
+            deliver(ctx, constant(args[1]), true);
+        }
+        else if (name == "quasiquote")
+            compile(list.quasiquoted(), ctx);
+        else if (name == "macroexpand") {
+            HOOLIB_THROW_UNLESS(args.size() == 2,
+                                "invalid number of arguments");
+            deliver(ctx, "macroexpand(" + constant(args[1]) +
+                             ", malc::globals())");
+        }
+        else if (name == "try*")
+            compile_try(args, ctx);
+        else
+            return false;
+        return true;
+    }
+
+    void compile(MalTypePtr ast, const Context& ctx)
+    {
+        // A local named like a macro isn't a macro call.
+        auto head = head_symbol(ast);
+        if (!head || !local(head->name())) ast = macroexpand(ast, env_);
+
+        if (is_simple(ast)) {
+            auto symbol = ast->as_symbol();
+            return deliver(ctx, value(ast),
+                           !symbol || local(symbol->name()));
+        }
+
+        if (auto vector = ast->as_vector()) {
+            std::string items;
+            for (auto&& item : vector->get())
+                items += (items.empty() ? "" : ", ") + value(item);
+            return deliver(ctx, "mal::vector({" + items + "})");
+        }
+
+        if (auto hash = ast->as_hash_map()) {
+            std::string items;
+            for (auto && [ key, item ] : hash->data())
+                items += (items.empty() ? "{" : ", {") + literal(key) + ", " +
+                         value(item) + "}";
+            return deliver(ctx, "mal::hash_map({" + items + "})");
+        }
+
+        auto list = ast->as_list();
+        if (!list) return deliver(ctx, constant(ast), true);
+        head = head_symbol(ast);
+        if (head && compile_special(head->name(), *list, ctx)) return;
+        compile_call(list->get(), ctx);
+    }
+
+public:
+    Compiler(EnvPtr env) : env_(std::move(env)) {}
+
+    // compiles a form of the program, evaluating the definitions that
+    // macros may use
+    void compile_toplevel(MalTypePtr ast)
+    {
+        ast = macroexpand(ast, env_);
+        if (is_form(ast, "do")) {
+            const auto& items = ast->as_list()->get();
+            for (size_t i = 1; i < items.size(); i++)
+                compile_toplevel(items[i]);
+            return;
+        }
+        if (is_form(ast, "load-file")) {
+            const auto& items = ast->as_list()->get();
+            if (items.size() == 2 && items[1]->as_string()) {
+                load_file(items[1]->as_string()->get());
+                return;
+            }
+        }
+        const auto& items = ast->as_list() ? ast->as_list()->get()
+                                           : std::vector<MalTypePtr>();
+        if (is_form(ast, "defmacro!") ||
+            (is_form(ast, "def!") && items.size() == 3 &&
+             is_form(items[2], "fn*")))
+            mal_eval(ast, env_);
+
+        open("{");
+        compile(ast, discard());
+        close();
+    }
+
+    void load_file(const std::string& filename)
+    {
+        auto ast = Reader("(do " + HooLib::read_file_all(filename) + ")").parse();
+        HOOLIB_THROW_UNLESS(ast, "invalid src");
+        compile_toplevel(ast);
+    }
+
+    void write(std::ostream& os, const std::string& filename)
+    {
+        os << "// Compiled by malc from " << filename << "\n"
+           << "#include \"malc.hpp\"\n"
+           << "\n"
+           << "namespace {\n"
+           << header_.str() << "}  // namespace\n"
+           << "\n"
+           << "int main(int argc, char** argv)\n"
+           << "{\n"
+           << "    malc::init(argc, argv);\n"
+           << "    try {\n"
+           << main_.str() << "    }\n"
+           << "    catch (std::runtime_error& ex) {\n"
+           << "        std::cerr << \"RUNTIME_ERROR: \" << ex.what() << "
+              "std::endl;\n"
+           << "    }\n"
+           << "    return 0;\n"
+           << "}\n";
+    }
+};
+}  // namespace
+
+int main(int argc, char** argv)
+{
+    std::string input, output;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "-o" && i + 1 < argc)
+            output = argv[++i];
+        else
+            input = arg;
+    }
+    if (input.empty()) {
+        std::cerr << "usage: malc prog.mal [-o prog.cpp]" << std::endl;
+        return 1;
+    }
+
+    try {
+        Compiler compiler(malc::init(0, nullptr));
+        compiler.load_file(input);
+        if (output.empty()) {
+            compiler.write(std::cout, input);
+        }
+        else {
+            std::ofstream ofs(output);
+            compiler.write(ofs, input);
+            HOOLIB_THROW_UNLESS(ofs, "can't write " + output);
+        }
+    }
+    catch (mal::Exception& ex) {
+        std::cerr << "malc: " << ex.get()->pr_str(true) << std::endl;
+        return 1;
+    }
+    catch (std::runtime_error& ex) {
+        std::cerr << "malc: " << ex.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
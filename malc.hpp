@@ -0,0 +1,122 @@
+#pragma once
+#ifndef MAL_MALC_HPP
+#define MAL_MALC_HPP
+
+#include <iostream>
+#include "env.hpp"
+#include "exception.hpp"
+#include "factory.hpp"
+
+// Runtime of the programs malc compiles. The generated C++ keeps locals in
+// C++ variables, and comes here for globals, calls and constants. The
+// builtins are those of stepA in core.cpp.
+namespace malc {
+// sets up the root environment: the builtins, eval, not, load-file and
+// *ARGV* from argv[1..]
+const EnvPtr& init(int argc, char** argv);
+const EnvPtr& globals();
+
+// a constant printed by malc, read back
+MalTypePtr constant(const std::string& src);
+
+inline bool is_true(const MalTypePtr& value)
+{
+    static const MalType* const nil = mal::nil().get();
+    static const MalType* const false_ = mal::false_().get();
+    return value.get() != nil && value.get() != false_;
+}
+
+// A global the program refers to. It's looked up again only when it's not
+// bound yet or a global has been redefined since; see Env::generation().
+class Global {
+private:
+    std::string name_;
+    MalTypePtr value_;
+    uint64_t generation_ = 0;
+
+public:
+    Global(std::string name) : name_(std::move(name)) {}
+
+    const MalTypePtr& get()
+    {
+        if (!value_ || generation_ != Env::generation()) {
+            value_ = globals()->get(name_);
+            generation_ = Env::generation();
+        }
+        return value_;
+    }
+
+    void set(const MalTypePtr& value)
+    {
+        globals()->set(name_, value);
+        value_ = value;
+        generation_ = Env::generation();
+    }
+};
+
+// A function made from fn*. The body gets the function itself as well, so
+// that a tail call to itself can jump back to the beginning instead.
+template <class F>
+class Function : public MalFunction {
+private:
+    F body_;
+
+public:
+    Function(F body) : body_(std::move(body)) {}
+
+    MalTypePtr callN(const Args& args) override { return body_(*this, args); }
+};
+
+template <class F>
+std::shared_ptr<MalFunction> function(F body)
+{
+    return mal::make_shared<Function<F>>(std::move(body));
+}
+
+inline void check_arity(const MalFunction::Args& args, size_t nfixed,
+                        bool variadic)
+{
+    HOOLIB_THROW_UNLESS((variadic && args.size() >= nfixed) ||
+                            (!variadic && args.size() == nfixed),
+                        "invalid argument");
+}
+
+// the arguments bound to the parameter after &
+inline MalTypePtr rest(const MalFunction::Args& args, size_t nfixed)
+{
+    return mal::list(std::vector<MalTypePtr>(args.begin() + nfixed, args.end()));
+}
+
+inline MalFunction& callee(const MalTypePtr& value)
+{
+    auto func = dynamic_cast<MalFunction*>(value.get());
+    HOOLIB_THROW_UNLESS(func, "invalid argument");
+    return *func;
+}
+
+inline MalTypePtr call(const MalTypePtr& func)
+{
+    return callee(func).callN(MalFunction::Args(nullptr, nullptr));
+}
+
+inline MalTypePtr call(const MalTypePtr& func, const MalTypePtr& arg)
+{
+    return callee(func).call1(arg);
+}
+
+inline MalTypePtr call(const MalTypePtr& func, const MalTypePtr& lhs,
+                       const MalTypePtr& rhs)
+{
+    return callee(func).call2(lhs, rhs);
+}
+
+template <class... T>
+MalTypePtr call(const MalTypePtr& func, const T&... args)
+{
+    const MalTypePtr argv[] = {args...};
+    return callee(func).callN(
+        MalFunction::Args(argv, argv + sizeof...(args)));
+}
+}  // namespace malc
+
+#endif
@@ -0,0 +1,38 @@
+#include "core.hpp"
+#include "malc.hpp"
+#include "reader.hpp"
+
+namespace malc {
+const EnvPtr& globals()
+{
+    static EnvPtr repl_env = mal::make_shared<Env>();
+    return repl_env;
+}
+
+const EnvPtr& init(int argc, char** argv)
+{
+    const auto& repl_env = globals();
+    mal::core::init(repl_env);
+
+    // define eval
+    repl_env->set("eval", mal::function([](auto&& args) {
+                      HOOLIB_THROW_UNLESS(args.size() == 1,
+                                          "invalid number of arguments");
+                      return mal_eval(args[0], globals());
+                  }));
+
+    // define *ARGV*
+    std::vector<MalTypePtr> argv_list;
+    for (int i = 1; i < argc; i++) argv_list.push_back(mal::string(argv[i]));
+    repl_env->set("*ARGV*", mal::list(argv_list));
+
+    return repl_env;
+}
+
+MalTypePtr constant(const std::string& src)
+{
+    auto value = Reader(src).parse();
+    HOOLIB_THROW_UNLESS(value, "invalid constant");
+    return value;
+}
+}  // namespace malc
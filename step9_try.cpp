@@ -283,7 +283,7 @@ std::unordered_map<std::string, MalFunction::Func> get_ns()
              std::copy(args.begin() + 2, args.end(),
                        std::back_inserter(new_args));
 
-             auto res = func->call(MalFunction::Args(HOOLIB_RANGE(new_args)));
+             auto res = func->callN(MalFunction::Args(new_args));
              atm->set_ref(res);
              return res;
          }},
@@ -308,7 +308,7 @@ std::unordered_map<std::string, MalFunction::Func> get_ns()
              for (size_t i = 1; i < args.size() - 1; i++)
                  list.push_back(args[i]);
              std::copy(HOOLIB_RANGE(seq->get()), std::back_inserter(list));
-             return func->call(MalFunction::Args(HOOLIB_RANGE(list)));
+             return func->callN(MalFunction::Args(list));
          }},
         {"map",
          [](auto&& args) {
@@ -322,7 +322,7 @@ std::unordered_map<std::string, MalFunction::Func> get_ns()
                  [&func](auto&& item) {
                      std::vector<MalTypePtr> args;
                      args.push_back(item);
-                     return func->call(MalFunction::Args(HOOLIB_RANGE(args)));
+                     return func->callN(MalFunction::Args(args));
                  });
              return mal::list(ret_src);
          }},
@@ -551,7 +551,7 @@ int main(int argc, char** argv)
     else {
         try {
             std::stringstream ss;
-            ss << "(load-file \"" << HooLib::cpp_escape_string(argv[0]) << "\")"
+            ss << "(load-file " << HooLib::cpp_escape_string(argv[1]) << ")"
                << std::endl;
             eval_str(ss.str(), repl_env);
         }
@@ -0,0 +1,210 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include "core.hpp"
+#include "env.hpp"
+#include "exception.hpp"
+#include "factory.hpp"
+#include "helper.hpp"
+#include "jit.hpp"
+#include "reader.hpp"
+#include "vm.hpp"
+
+MalTypePtr eval_special(MalTypePtr ast, EnvPtr env);
+
+#ifdef MAL_COUNT_ALLOCATIONS
+// Heap allocations so far and those not freed yet, exposed as
+// allocation-count and live-allocation-count. The compiler thread of
+// tiering allocates too. Only stepA_mal_alloc counts them, so that
+// stepA_mal's allocations don't pay for it.
+std::atomic<size_t> allocation_count = 0, live_allocation_count = 0;
+
+void* operator new(size_t size)
+{
+    allocation_count.fetch_add(1, std::memory_order_relaxed);
+    live_allocation_count.fetch_add(1, std::memory_order_relaxed);
+    if (void* ptr = std::malloc(size == 0 ? 1 : size)) return ptr;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept
+{
+    if (ptr) live_allocation_count.fetch_sub(1, std::memory_order_relaxed);
+    std::free(ptr);
+}
+void operator delete(void* ptr, size_t) noexcept { operator delete(ptr); }
+#endif
+
+MalTypePtr READ(std::istream& is)
+{
+    std::string input;
+    if (!std::getline(is, input)) return nullptr;
+    return Reader(input).parse();
+}
+
+// MAL_ENGINE=vm selects the bytecode engine instead of the tree walker.
+bool use_vm = false;
+
+MalTypePtr EVAL(MalTypePtr ast, EnvPtr env)
+{
+    if (use_vm) return mal::vm::eval(ast, env);
+    return mal_eval(ast, env);
+}
+
+void PRINT(MalTypePtr ast, std::ostream& os)
+{
+    HOOLIB_THROW_UNLESS(ast, "invalid ast");
+    std::string out;
+    ast->print(out, true);
+    out += '\n';
+    os << out << std::flush;
+}
+
+// builtins of stepA_mal only, to look into the interpreter
+std::unordered_map<std::string, std::shared_ptr<MalFunction>> get_ns()
+{
+    return {
+#ifdef MAL_COUNT_ALLOCATIONS
+        {"allocation-count",
+         mal::function([](auto&& args) {
+             HOOLIB_THROW_UNLESS(args.size() == 0,
+                                 "invalid number of arguments");
+             return mal::int_(allocation_count);
+         })},
+        {"live-allocation-count",
+         mal::function([](auto&& args) {
+             HOOLIB_THROW_UNLESS(args.size() == 0,
+                                 "invalid number of arguments");
+             return mal::int_(live_allocation_count);
+         })},
+#endif
+        {"call-site-stats",
+         mal::function([](auto&& args) {
+             HOOLIB_THROW_UNLESS(args.size() == 0,
+                                 "invalid number of arguments");
+             // [form hits misses] of each call site, the busiest first
+             auto sites = mal::call_sites();
+             auto calls = [](auto site) {
+                 return site->hits() + site->misses();
+             };
+             std::sort(sites.begin(), sites.end(), [&](auto lhs, auto rhs) {
+                 return calls(lhs) > calls(rhs);
+             });
+             std::vector<MalTypePtr> ret_src;
+             for (auto&& site : sites) {
+                 if (calls(site) == 0) break;
+                 ret_src.push_back(mal::vector(
+                     {mal::string(site->list().pr_str(true)),
+                      mal::int_(site->hits()), mal::int_(site->misses())}));
+             }
+             return mal::list(std::move(ret_src));
+         })},
+        {"tier-stats",
+         mal::function([](auto&& args) {
+             HOOLIB_THROW_UNLESS(args.size() == 0,
+                                 "invalid number of arguments");
+             auto stats = mal::vm::tiering_stats();
+             auto jit = mal::jit::stats();
+             auto key = mal::helper::string2keyword;
+             return mal::hash_map(
+                 {{key("threshold"), mal::int_(mal::tier_up_threshold())},
+                  {key("promoted"), mal::int_(stats.promoted)},
+                  {key("rejected"), mal::int_(stats.rejected)},
+                  {key("pending"), mal::int_(stats.pending)},
+                  {key("compile-us"), mal::int_(stats.compile_us)},
+                  {key("jitted"), mal::int_(jit.compiled)},
+                  {key("jit-bailouts"), mal::int_(jit.bailouts)}});
+         })},
+    };
+}
+
+MalTypePtr eval_str(const std::string& src, const EnvPtr& env)
+{
+    std::stringstream ss(src);
+    auto ast = READ(ss);
+    HOOLIB_THROW_UNLESS(ast, "invalid src");
+    return EVAL(ast, env);
+}
+
+int rep(const EnvPtr& repl_env, std::istream& is = std::cin)
+{
+    auto ast = READ(is);
+    if (!ast) return 1;
+    PRINT(EVAL(ast, repl_env), std::cout);
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    if (auto engine = std::getenv("MAL_ENGINE"))
+        use_vm = std::string(engine) == "vm";
+    // MAL_STACK_LIMIT: the limit of the evaluator's stack in megabytes
+    if (auto limit = std::getenv("MAL_STACK_LIMIT"))
+        mal::set_stack_limit(std::stoull(limit) << 20);
+    // MAL_FOLD=0 turns off evaluating constant calls in advance
+    if (auto fold = std::getenv("MAL_FOLD"))
+        mal::set_constant_folding(std::string(fold) != "0");
+    // MAL_INLINE=0 turns off inlining small global functions
+    if (auto inline_ = std::getenv("MAL_INLINE"))
+        mal::set_inlining(std::string(inline_) != "0");
+    // MAL_TIER: the number of calls after which a closure is compiled into
+    // bytecode. 0 turns it off.
+    mal::vm::set_tiering(1000);
+    if (auto tier = std::getenv("MAL_TIER"))
+        mal::vm::set_tiering(std::stoul(tier));
+
+    EnvPtr repl_env = mal::make_shared<Env>();
+    mal::core::init(repl_env);
+    for (auto && [ name, func ] : get_ns()) repl_env->set(name, func);
+
+    // MAL_JIT=1 lets tiering translate integer functions into machine code
+    if (auto jit = std::getenv("MAL_JIT"))
+        if (std::string(jit) == "1") mal::jit::set_enabled(repl_env);
+
+    // define eval
+    repl_env->set("eval",
+                  mal::make_shared<MalFunction>([&repl_env](auto&& args) {
+                      HOOLIB_THROW_UNLESS(args.size() == 1,
+                                          "invalid number of arguments");
+                      return EVAL(args[0], repl_env);
+                  }));
+
+    // define *ARGV*
+    std::vector<MalTypePtr> argv_list;
+    for (int i = 2; i < argc; i++) argv_list.push_back(mal::string(argv[i]));
+    repl_env->set("*ARGV*", mal::list(argv_list));
+
+    if (argc == 1) {  // REPL
+        while (true) {
+            try {
+                std::cout << "user> " << std::flush;
+                if (rep(repl_env)) break;
+            }
+            catch (mal::Exception& ex) {
+                std::cerr << "RUNTIME_ERROR: " << ex.get()->pr_str(true)
+                          << std::endl;
+            }
+            catch (std::runtime_error& ex) {
+                std::cerr << "RUNTIME_ERROR: " << ex.what() << std::endl;
+            }
+        }
+    }
+    else {
+        try {
+            std::stringstream ss;
+            ss << "(load-file " << HooLib::cpp_escape_string(argv[1]) << ")"
+               << std::endl;
+            eval_str(ss.str(), repl_env);
+        }
+        catch (std::runtime_error& ex) {
+            std::cerr << "RUNTIME_ERROR: " << ex.what() << std::endl;
+        }
+    }
+
+    return 0;
+}
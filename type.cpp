@@ -1,30 +1,765 @@
 #include "type.hpp"
+#include <algorithm>
+#include <deque>
+#include <limits>
+#include <typeinfo>
+#include <unordered_set>
 #include "exception.hpp"
 #include "factory.hpp"
 #include "helper.hpp"
 
-using TCOSwitch = std::variant<MalTypePtr, std::tuple<MalTypePtr, EnvPtr>>;
+MalTypePtr MalSymbol::eval(EnvPtr env) { return env->get(name_); }
 
-TCOSwitch mal_eval_special(MalTypePtr ast, EnvPtr env);
-MalTypePtr quasiquote(const MalTypePtr& ast);
-MalTypePtr macroexpand(MalTypePtr ast, const EnvPtr& env);
+void MalAtom::print(std::string& out, bool print_readably) const
+{
+    out += "(atom ";
+    ref_->print(out, print_readably);
+    out += ')';
+}
 
-MalTypePtr MalSymbol::eval(EnvPtr env) { return env->get(name_); }
+void MalString::print(std::string& out, std::string_view data,
+                      bool print_readably)
+{
+    if (mal::helper::is_keyword(data)) {
+        out += ':';
+        out += data.substr(1);
+        return;
+    }
+    if (print_readably)
+        HooLib::cpp_escape_string(out, data);
+    else
+        out += data;
+}
+
+std::shared_ptr<MalString> MalString::slice(size_t pos, size_t len) const
+{
+    auto slice = view().substr(pos, len);
+    if (slice.size() <= std::string().capacity())
+        return mal::make_shared<MalString>(std::string(slice));
+    return mal::make_shared<MalString>(base_ ? base_ : as_string(), slice);
+}
+
+namespace {
+uint32_t tiering_threshold = 0;
+mal::TierUpHook tiering_hook = nullptr;
+
+// Deeper than this, closures are evaluated by the mal_eval at hand instead
+// of their tiered form, so that calls between tiered closures and the
+// others stop nesting engines and go on in the frames of mal_eval.
+constexpr size_t max_tiered_depth = 8;
+
+// the faster form of closure to call instead, if it has got one. Otherwise
+// the call is counted.
+MalFunction* tier_up(MalClosure& closure)
+{
+    if (auto tiered = closure.tiered())
+        return mal::EngineEntry::depth() < max_tiered_depth ? tiered : nullptr;
+    if (closure.count_call() == tiering_threshold)
+        tiering_hook(closure.as_closure());
+    return nullptr;
+}
+
+// typeid rather than as_integer(), which copies a shared_ptr
+long long int fixnum(const MalTypePtr& value)
+{
+    HOOLIB_THROW_UNLESS(typeid(*value) == typeid(MalInteger),
+                        "invalid argument");
+    return static_cast<const MalInteger&>(*value).get();
+}
+
+long long int combine(MalArithmetic::Op op, long long int lhs,
+                      long long int rhs)
+{
+    long long int result;
+    switch (op) {
+        case MalArithmetic::Op::ADD:
+            if (__builtin_add_overflow(lhs, rhs, &result)) break;
+            return result;
+        case MalArithmetic::Op::SUB:
+            if (__builtin_sub_overflow(lhs, rhs, &result)) break;
+            return result;
+        case MalArithmetic::Op::MUL:
+            if (__builtin_mul_overflow(lhs, rhs, &result)) break;
+            return result;
+        default:
+            if (rhs == 0) MAL_THROW_STRING("division by zero");
+            if (lhs == std::numeric_limits<long long int>::min() && rhs == -1)
+                break;
+            return lhs / rhs;
+    }
+    MAL_THROW_STRING("integer overflow");
+}
+
+bool compare(MalArithmetic::Op op, long long int lhs, long long int rhs)
+{
+    switch (op) {
+        case MalArithmetic::Op::LT:
+            return lhs < rhs;
+        case MalArithmetic::Op::LE:
+            return lhs <= rhs;
+        case MalArithmetic::Op::GT:
+            return lhs > rhs;
+        default:
+            return lhs >= rhs;
+    }
+}
+}  // namespace
+
+MalTypePtr MalArithmetic::apply(const Args& args) const
+{
+    auto size = args.size();
+    if (op_ == Op::ADD || op_ == Op::MUL) {
+        if (size == 0) return mal::int_(op_ == Op::ADD ? 0 : 1);
+    }
+    else {
+        HOOLIB_THROW_UNLESS(size != 0, "invalid number of arguments");
+    }
+
+    auto it = args.begin();
+    auto acc = fixnum(*it);
+    if (op_ >= Op::LT) {  // (< a b c) is (and (< a b) (< b c))
+        bool result = true;
+        while (++it != args.end()) {
+            auto rhs = fixnum(*it);
+            result = result && compare(op_, acc, rhs);
+            acc = rhs;
+        }
+        return mal::boolean(result);
+    }
+
+    // (- x) is (- 0 x) and (/ x) is (/ 1 x)
+    if (size == 1 && (op_ == Op::SUB || op_ == Op::DIV))
+        return mal::int_(combine(op_, op_ == Op::SUB ? 0 : 1, acc));
+    while (++it != args.end()) acc = combine(op_, acc, fixnum(*it));
+    return mal::int_(acc);
+}
+
+namespace {
+bool is_special_form(const std::string& name)
+{
+    static const std::unordered_set<std::string> names = {
+        "def!",   "defmacro!",      "let*",        "do",   "if",
+        "fn*",    "quote",          "quasiquote",  "unquote",
+        "splice-unquote",           "macroexpand", "try*", "catch*",
+        "loop*",  "recur",          "cond",        "and",  "or",
+        "when",   "when-not",       "->",          "->>"};
+    return names.count(name) != 0;
+}
+
+// throws unless every recur in ast is in tail position of the innermost
+// loop*. tail is whether ast itself is.
+void check_recur(MalTypePtr ast, const EnvPtr& env, bool tail)
+{
+    ast = macroexpand(ast, env);
+    if (auto hash = ast->as_hash_map()) {
+        for (auto && [ key, value ] : hash->data())
+            check_recur(value, env, false);
+        return;
+    }
+    auto seq = ast->as_sequential();
+    if (!seq) return;
+    const auto& args = seq->get();
+    auto symbol = ast->as_list() && !args.empty() ? args[0]->as_symbol()
+                                                  : nullptr;
+    auto name = symbol ? symbol->name() : "";
+    auto check_all = [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) check_recur(args[i], env, false);
+    };
+
+    if (name == "recur") {
+        HOOLIB_THROW_UNLESS(tail, "recur not in tail position");
+        check_all(1, args.size());
+    }
+    else if (name == "quote" || name == "macroexpand") {
+    }
+    else if (name == "if" && args.size() >= 3) {
+        check_recur(args[1], env, false);
+        for (size_t i = 2; i < args.size(); i++)
+            check_recur(args[i], env, tail);
+    }
+    else if ((name == "do" || name == "and" || name == "or") &&
+             args.size() >= 2) {
+        check_all(1, args.size() - 1);
+        check_recur(args.back(), env, tail);
+    }
+    else if ((name == "when" || name == "when-not") && args.size() >= 3) {
+        check_all(1, args.size() - 1);
+        check_recur(args.back(), env, tail);
+    }
+    else if (name == "cond") {
+        for (size_t i = 1; i < args.size(); i++)
+            check_recur(args[i], env, tail && i % 2 == 0);
+    }
+    else if (name == "->" || name == "->>") {
+        check_recur(ast->as_list()->threaded(), env, tail);
+    }
+    else if ((name == "let*" || name == "loop*") && args.size() == 3) {
+        if (auto bindings = args[1]->as_sequential())
+            for (size_t i = 1; i < bindings->get().size(); i += 2)
+                check_recur(bindings->get()[i], env, false);
+        check_recur(args[2], env, name == "loop*" || tail);
+    }
+    else if (name == "try*" && args.size() == 3) {
+        check_recur(args[1], env, false);
+        auto handler = args[2]->as_list();
+        if (handler && handler->get().size() == 3)
+            check_recur(handler->get()[2], env, tail);
+    }
+    else if (name == "fn*" && args.size() == 3) {
+        check_recur(args[2], env, false);
+    }
+    else {
+        check_all(symbol ? 1 : 0, args.size());
+    }
+}
+
+// collects the free variables of an AST. Returns false if it can't tell.
+class FreeVariableFinder {
+private:
+    std::vector<std::string> bound_;
+    std::vector<MalLambda::FreeVariable>& free_;
+
+    bool is_bound(const std::string& name) const
+    {
+        return std::find(bound_.begin(), bound_.end(), name) != bound_.end();
+    }
+
+    void add(const std::string& name, bool is_called)
+    {
+        if (is_bound(name) || is_special_form(name)) return;
+        for (auto&& var : free_) {
+            if (var.name != name) continue;
+            var.is_called = var.is_called || is_called;
+            return;
+        }
+        free_.push_back({name, is_called});
+    }
+
+    bool bind(const MalTypePtr& symbol)
+    {
+        auto sym = symbol->as_symbol();
+        if (!sym) return false;
+        if (sym->name() != "&") bound_.push_back(sym->name());
+        return true;
+    }
+
+    bool visit_all(const std::vector<MalTypePtr>& items, size_t begin = 0)
+    {
+        for (size_t i = begin; i < items.size(); i++)
+            if (!visit(items[i])) return false;
+        return true;
+    }
+
+    bool visit_list(const std::vector<MalTypePtr>& args)
+    {
+        if (args.empty()) return true;
+        auto head = args[0]->as_symbol();
+        if (!head) return visit_all(args);
+
+        const auto& name = head->name();
+        if (is_bound(name) || !is_special_form(name)) {
+            add(name, true);
+            return visit_all(args, 1);
+        }
+
+        if (name == "quote") return true;
+        if (name == "def!" || name == "defmacro!") return false;
+
+        auto depth = bound_.size();
+        if (name == "let*" || name == "loop*") {
+            if (args.size() != 3) return false;
+            auto binds = args[1]->as_sequential();
+            if (!binds || binds->get().size() % 2 != 0) return false;
+            const auto& items = binds->get();
+            for (size_t i = 0; i < items.size(); i += 2)
+                if (!visit(items[i + 1]) || !bind(items[i])) return false;
+            if (!visit(args[2])) return false;
+        }
+        else if (name == "fn*") {
+            if (args.size() != 3) return false;
+            auto params = args[1]->as_sequential();
+            if (!params) return false;
+            for (auto&& param : params->get())
+                if (!bind(param)) return false;
+            if (!visit(args[2])) return false;
+        }
+        else if (name == "try*") {
+            if (args.size() != 2 && args.size() != 3) return false;
+            if (!visit(args[1])) return false;
+            if (args.size() == 3) {
+                auto handler = args[2]->as_list();
+                if (!handler || handler->get().size() != 3 ||
+                    !bind(handler->get()[1]) || !visit(handler->get()[2]))
+                    return false;
+            }
+        }
+        else if (!visit_all(args, 1)) {
+            return false;
+        }
+        bound_.resize(depth);
+        return true;
+    }
+
+public:
+    FreeVariableFinder(std::vector<std::string> bound,
+                       std::vector<MalLambda::FreeVariable>& free)
+        : bound_(std::move(bound)), free_(free)
+    {
+    }
+
+    bool visit(const MalTypePtr& ast)
+    {
+        if (auto symbol = ast->as_symbol()) {
+            add(symbol->name(), false);
+            return true;
+        }
+        if (auto list = ast->as_list()) {
+            const auto& items = list->get();
+            auto head = items.empty() ? nullptr : items[0]->as_symbol();
+            if (head && (head->name() == "->" || head->name() == "->>") &&
+                !is_bound(head->name()))
+                return visit(list->threaded());
+            return visit_list(items);
+        }
+        if (auto seq = ast->as_sequential()) return visit_all(seq->get());
+        if (auto hash_map = ast->as_hash_map()) {
+            for (auto && [ key, value ] : hash_map->data())
+                if (!visit(value)) return false;
+        }
+        return true;
+    }
+};
+}  // namespace
+
+void MalList::check_loop(const EnvPtr& env) const
+{
+    if (is_checked_loop_) return;
+    check_recur(get()[2], env, true);
+    is_checked_loop_ = true;
+}
+
+const MalTypePtr& MalList::threaded() const
+{
+    if (expansion_) return expansion_;
+
+    const auto& args = get();
+    HOOLIB_THROW_UNLESS(args.size() >= 2, "invalid number of arguments");
+    bool last = args[0]->as_symbol()->name() == "->>";
+    auto value = args[1];
+    for (size_t i = 2; i < args.size(); i++) {
+        auto form = args[i]->as_list();
+        if (!form) {
+            value = mal::list({args[i], value});
+            continue;
+        }
+        std::vector<MalTypePtr> items = form->get();
+        HOOLIB_THROW_UNLESS(!items.empty(), "invalid argument");
+        items.insert(last ? items.end() : items.begin() + 1, value);
+        value = mal::list(items);
+    }
+
+    expansion_ = value;
+    return expansion_;
+}
+
+const MalTypePtr& MalList::quasiquoted() const
+{
+    if (expansion_) return expansion_;
+    HOOLIB_THROW_UNLESS(get().size() == 2, "invalid number of arguments");
+    expansion_ = quasiquote(get()[1]);
+    return expansion_;
+}
+
+struct MalFolding {
+    // false if the list is not a call to pure functions with constant
+    // arguments. It's not looked at again then.
+    bool is_constant = true;
+    // the callees and what they were bound to
+    std::vector<std::pair<std::string, MalTypePtr>> callees;
+    MalTypePtr value;  // nullptr if a callee isn't pure or failed
+};
+
+namespace {
+bool is_constant_folding = true;
+
+// the value of ast if it's a constant. Records callees into folding.
+MalTypePtr constant_value(const MalTypePtr& ast, const EnvPtr& env,
+                          MalFolding& folding)
+{
+    if (ast->as_integer() || ast->as_string() || ast->as_nil() ||
+        ast->as_true() || ast->as_false())
+        return ast;
+
+    if (ast->as_vector()) {
+        std::vector<MalTypePtr> items;
+        for (auto&& item : ast->as_vector()->get()) {
+            items.push_back(constant_value(item, env, folding));
+            if (!items.back()) return nullptr;
+        }
+        return mal::vector(items);
+    }
+
+    auto list = ast->as_list();
+    if (!list) {
+        folding.is_constant = false;
+        return nullptr;
+    }
+    const auto& args = list->get();
+    if (args.empty()) return ast;
+    auto symbol = args[0]->as_symbol();
+    if (symbol && symbol->name() == "quote" && args.size() == 2)
+        return args[1];
+    if (!(symbol || args[0]->as_function()) ||
+        (symbol && is_special_form(symbol->name()))) {
+        folding.is_constant = false;
+        return nullptr;
+    }
+
+    // A function in place of the callee's name comes from inlined().
+    auto value = symbol ? env->get_if(symbol->name()) : args[0];
+    auto func = value ? value->as_function() : nullptr;
+    if (!func || !func->is_pure()) {
+        folding.is_constant = false;
+        return nullptr;
+    }
+    if (symbol) folding.callees.emplace_back(symbol->name(), value);
+
+    std::vector<MalTypePtr> values;
+    for (size_t i = 1; i < args.size(); i++) {
+        values.push_back(constant_value(args[i], env, folding));
+        if (!values.back()) return nullptr;
+    }
+    try {
+        return func->callN(MalFunction::Args(values));
+    }
+    catch (mal::Exception&) {
+    }
+    catch (std::runtime_error&) {
+    }
+    return nullptr;  // leave the error to the evaluation
+}
+}  // namespace
 
-std::string MalAtom::pr_str(bool print_readably) const
+MalTypePtr MalList::fold(const EnvPtr& env) const
 {
-    std::stringstream ss;
-    ss << "(atom " << ref_->pr_str(print_readably) << ")";
-    return ss.str();
+    if (folding_) {
+        if (!folding_->is_constant) return nullptr;
+        bool is_valid = std::all_of(
+            folding_->callees.begin(), folding_->callees.end(),
+            [&env](auto&& callee) {
+                return env->get_if(callee.first) == callee.second;
+            });
+        if (is_valid) return folding_->value;
+    }
+
+    static const auto not_constant = std::make_shared<MalFolding>(
+        MalFolding{false, {}, nullptr});
+    MalFolding folding;
+    folding.value = constant_value(
+        std::const_pointer_cast<MalType>(shared_from_this()), env, folding);
+    if (folding.is_constant)
+        folding_ = std::make_shared<MalFolding>(std::move(folding));
+    else
+        folding_ = not_constant;
+    return folding_->value;
+}
+
+struct MalInlining {
+    uint64_t generation;
+    MalTypePtr callee;
+    MalTypePtr ast;  // nullptr if the call can't be inlined
+};
+
+namespace {
+bool is_inlining = true;
+
+bool is_literal(const MalTypePtr& ast)
+{
+    return ast->as_integer() || ast->as_string() || ast->as_nil() ||
+           ast->as_true() || ast->as_false();
+}
+
+// head as the name of a global function that can be inlined into a call
+// with nargs arguments
+std::shared_ptr<MalClosure> inlinable_closure(const MalTypePtr& head,
+                                              size_t nargs, Env& root)
+{
+    auto symbol = head->as_symbol();
+    if (!symbol) return nullptr;
+    auto value = root.lookup(symbol->name());
+    auto closure = value ? (*value)->as_closure() : nullptr;
+    if (!closure || closure->is_macro() || closure->is_variadic() ||
+        closure->env().get() != &root || closure->params().size() != nargs)
+        return nullptr;
+    return closure;
+}
+
+// Substitutes args for params in the body of a global function. Returns
+// nullptr if the body is too large or does more than calling builtins.
+class Inliner {
+private:
+    const std::vector<std::string>& params_;
+    const std::vector<MalTypePtr>& args_;
+    Env& root_;
+    size_t depth_, size_;
+    // the order the parameters are evaluated in, and if any of them is
+    // evaluated only conditionally
+    std::vector<size_t> uses_;
+    bool is_conditional_ = false, has_impure_call_ = false;
+
+public:
+    static constexpr size_t max_size = 32, max_depth = 4;
+
+    Inliner(const std::vector<std::string>& params,
+            const std::vector<MalTypePtr>& args, Env& root, size_t depth = 0,
+            size_t size = 0)
+        : params_(params), args_(args), root_(root), depth_(depth), size_(size)
+    {
+    }
+
+    MalTypePtr inline_body(const MalTypePtr& body)
+    {
+        auto ast = substitute(body, false);
+        if (!ast) return nullptr;
+        // Arguments other than symbols and literals must be evaluated once
+        // each, in order and before anything with side effects.
+        if (std::all_of(args_.begin() + 1, args_.end(), [](auto&& arg) {
+                return arg->as_symbol() || is_literal(arg);
+            }))
+            return ast;
+        if (is_conditional_ || has_impure_call_) return nullptr;
+        for (size_t i = 0; i < params_.size(); i++)
+            if (i >= uses_.size() || uses_[i] != i) return nullptr;
+        return uses_.size() == params_.size() ? ast : nullptr;
+    }
+
+private:
+    MalTypePtr substitute(const MalTypePtr& ast, bool conditional)
+    {
+        if (++size_ > max_size) return nullptr;
+        if (is_literal(ast)) return ast;
+
+        if (auto symbol = ast->as_symbol()) {
+            const auto& name = symbol->name();
+            auto param = std::find(params_.begin(), params_.end(), name);
+            if (param != params_.end()) {
+                uses_.push_back(param - params_.begin());
+                is_conditional_ = is_conditional_ || conditional;
+                return args_[uses_.back() + 1];
+            }
+            auto value = root_.lookup(name);
+            if (!value || !(is_literal(*value) || (*value)->as_function()))
+                return nullptr;
+            auto func = (*value)->as_function();
+            if (func && (func->is_macro() || func->is_apply() ||
+                         func->as_closure()))
+                return nullptr;
+            return *value;
+        }
+
+        if (auto vector = ast->as_vector()) {
+            std::vector<MalTypePtr> items;
+            for (auto&& item : vector->get()) {
+                items.push_back(substitute(item, conditional));
+                if (!items.back()) return nullptr;
+            }
+            return mal::vector(items);
+        }
+
+        auto list = ast->as_list();
+        if (!list) return nullptr;
+        const auto& items = list->get();
+        if (items.empty()) return ast;
+
+        std::vector<MalTypePtr> new_items;
+        auto head = items[0]->as_symbol();
+        if (head && head->name() == "quote") return ast;
+        if (head && is_special_form(head->name())) {
+            static const std::unordered_set<std::string> conditionals = {
+                "if", "cond", "and", "or", "when", "when-not"};
+            bool is_conditional = conditionals.count(head->name()) != 0;
+            if (!is_conditional && head->name() != "do") return nullptr;
+            new_items.push_back(items[0]);
+            for (size_t i = 1; i < items.size(); i++) {
+                // Only the first operand of these is always evaluated.
+                new_items.push_back(substitute(
+                    items[i], conditional || (is_conditional && i > 1)));
+                if (!new_items.back()) return nullptr;
+            }
+            return mal::list(new_items);
+        }
+
+        // A call to another global function is inlined as well, down to
+        // max_depth. That also rules out recursion.
+        auto closure = head && std::find(params_.begin(), params_.end(),
+                                         head->name()) == params_.end()
+                           ? inlinable_closure(head, items.size() - 1, root_)
+                           : nullptr;
+        if (closure) {
+            if (depth_ == max_depth) return nullptr;
+            new_items.push_back(items[0]);
+            for (size_t i = 1; i < items.size(); i++) {
+                new_items.push_back(substitute(items[i], conditional));
+                if (!new_items.back()) return nullptr;
+            }
+            Inliner inliner(closure->params(), new_items, root_, depth_ + 1,
+                            size_);
+            auto body = inliner.inline_body(closure->body());
+            size_ = inliner.size_;
+            has_impure_call_ = has_impure_call_ || inliner.has_impure_call_;
+            return body;
+        }
+
+        for (auto&& item : items) {
+            new_items.push_back(substitute(item, conditional));
+            if (!new_items.back()) return nullptr;
+        }
+        auto func = new_items[0]->as_function();
+        if (!func) return nullptr;
+        has_impure_call_ = has_impure_call_ || !func->is_pure();
+        return mal::list(new_items);
+    }
+};
+}  // namespace
+
+MalTypePtr MalList::inlined(const EnvPtr& env) const
+{
+    auto generation = Env::generation();
+    if (inlining_ && inlining_->generation == generation) {
+        if (!inlining_->ast) return nullptr;
+        auto head = get()[0]->as_symbol();
+        if (env->get_if(head->name()) == inlining_->callee)
+            return inlining_->ast;
+    }
+
+    // shared by the lists that can't be inlined in this generation
+    static auto none = std::make_shared<MalInlining>();
+    if (none->generation != generation)
+        none = std::make_shared<MalInlining>(
+            MalInlining{generation, nullptr, nullptr});
+    inlining_ = none;
+
+    const auto& args = get();
+    auto head = args[0]->as_symbol();
+    if (!head || is_special_form(head->name())) return nullptr;
+    auto value = env->get_if(head->name());
+    auto closure = value ? value->as_closure() : nullptr;
+    if (!closure || closure->env()->outer() ||
+        inlinable_closure(head, args.size() - 1, *closure->env()) != closure)
+        return nullptr;
+
+    auto ast = Inliner(closure->params(), args, *closure->env())
+                   .inline_body(closure->body());
+    if (ast)
+        inlining_ = std::make_shared<MalInlining>(
+            MalInlining{generation, value, ast});
+    return ast;
+}
+
+namespace {
+// every alive MalCallSite, for mal::call_sites(). It's never destroyed, since
+// the sites in the ASTs held by globals outlive it otherwise.
+std::unordered_set<const MalCallSite*>& call_site_registry()
+{
+    static auto sites = new std::unordered_set<const MalCallSite*>();
+    return *sites;
+}
+}  // namespace
+
+MalCallSite::MalCallSite(const MalList& list) : list_(list)
+{
+    call_site_registry().insert(this);
+}
+
+MalCallSite::~MalCallSite() { call_site_registry().erase(this); }
+
+bool MalCallSite::update(const MalTypePtr& callee)
+{
+    auto func = callee->as_function();
+    if (!func) return false;
+    callee_ = callee.get();
+    alive_ = callee;
+    function_ = func.get();
+    if (func->is_apply())
+        kind_ = Kind::APPLY;
+    else if (func->as_closure())
+        kind_ = Kind::CLOSURE;
+    else if (dynamic_cast<MalArithmetic*>(function_))
+        kind_ = Kind::ARITHMETIC;
+    else if (func->is_throw())
+        kind_ = Kind::THROW;
+    else
+        kind_ = Kind::BUILTIN;
+    return true;
+}
+
+MalLambda::MalLambda(std::vector<std::string> params, bool variadic,
+                     MalTypePtr body)
+    : params_(std::move(params)), variadic_(variadic), body_(std::move(body))
+{
+    std::vector<FreeVariable> free;
+    if (FreeVariableFinder(params_, free).visit(body_)) free_ = std::move(free);
+}
+
+EnvPtr MalLambda::capture(const EnvPtr& env) const
+{
+    if (!free_ || !env->outer()) return env;
+
+    const EnvPtr* root = &env;
+    for (; (*root)->outer(); root = &(*root)->outer())
+        if (!(*root)->is_complete()) return env;
+
+    EnvPtr flat;
+    for (auto&& var : *free_) {
+        MalTypePtr* value = nullptr;
+        for (auto e = env.get(); e && !value; e = e->outer().get())
+            value = e->lookup(var.name);
+        if (!value) return env;
+        if (var.is_called) {
+            auto func = (*value)->as_function();
+            if (func && func->is_macro()) return env;
+        }
+        if ((*root)->lookup(var.name) == value) continue;  // global
+        if (!flat) {
+            flat = mal::make_shared<Env>(*root);
+            flat->reserve(free_->size());
+        }
+        flat->set(var.name, *value);
+    }
+    return flat ? flat : *root;
 }
 
-std::string MalString::pr_str(bool print_readably) const
+EnvPtr MalClosure::make_env(const Args& args, EnvPtr reusable) const
 {
-    if (mal::helper::is_keyword(data_))
-        return mal::helper::keyword2string(data_);
+    const auto& params = lambda_->params();
+    size_t nfixed = lambda_->nfixed();
+    bool variadic = lambda_->is_variadic();
+    HOOLIB_THROW_UNLESS(
+        (variadic && args.size() >= nfixed) ||
+            (!variadic && args.size() == nfixed),
+        "invalid argument");
+    EnvPtr env;
+    if (reusable && reusable.use_count() == 1 && reusable->outer() == env_) {
+        env = std::move(reusable);
+        env->clear();
+    }
+    else {
+        env = mal::make_shared<Env>(env_);
+        env->reserve(params.size());
+    }
+    for (size_t i = 0; i < nfixed; i++) env->set(params[i], args[i]);
+    if (variadic)
+        env->set(params.back(),
+                 mal::list(std::vector<MalTypePtr>(args.begin() + nfixed,
+                                                   args.end())));
+    return env;
+}
 
-    if (print_readably) return HooLib::cpp_escape_string(data_);
-    return data_;
+MalTypePtr MalClosure::callN(const Args& args)
+{
+    if (auto tiered = tier_up(*this))
+        if (auto value = tiered->try_callN(args)) return value;
+    return mal_eval(lambda_->body(), make_env(args));
 }
 
 std::vector<MalTypePtr> MalSequential::eval_items(EnvPtr env)
@@ -36,6 +771,7 @@ std::vector<MalTypePtr> MalSequential::eval_items(EnvPtr env)
 
 bool MalSequential::is_equal_to(const MalTypePtr& rhs) const
 {
+    if (auto lazy_seq = rhs->as_lazy_seq()) return lazy_seq->equals(items_);
     auto rhs_seq = rhs->as_sequential();
     if (!rhs_seq) return false;
     const auto& rhs_items = rhs_seq->items_;
@@ -50,6 +786,38 @@ MalTypePtr MalList::eval(EnvPtr env)
     return mal::make_shared<MalList>(eval_items(env));
 }
 
+const MalLambdaPtr& MalList::lambda() const
+{
+    if (lambda_) return lambda_;
+
+    const auto& args = get();
+    HOOLIB_THROW_UNLESS(args.size() == 3, "invalid number of arguments");
+    auto seq = args[1]->as_sequential();
+    HOOLIB_THROW_UNLESS(seq, "invalid argument");
+    const auto& binds_src = seq->get();
+    std::vector<std::string> binds;
+    bool variadic = false;
+    for (auto&& item : binds_src) {
+        auto symbol = item->as_symbol();
+        HOOLIB_THROW_UNLESS(symbol, "invalid argument");
+        if (symbol->name() == "&") {
+            variadic = true;
+            break;
+        }
+        binds.push_back(symbol->name());
+    }
+    if (variadic) {
+        HOOLIB_THROW_UNLESS(binds.size() + 2 == binds_src.size(),
+                            "invalid argument");
+        auto symbol = binds_src.back()->as_symbol();
+        HOOLIB_THROW_UNLESS(symbol, "invalid argument");
+        binds.push_back(symbol->name());
+    }
+
+    lambda_ = std::make_shared<MalLambda>(std::move(binds), variadic, args[2]);
+    return lambda_;
+}
+
 MalTypePtr MalVector::eval(EnvPtr env)
 {
     return mal::make_shared<MalVector>(eval_items(env));
@@ -57,199 +825,750 @@ MalTypePtr MalVector::eval(EnvPtr env)
 
 ///
 
-MalTypePtr mal_eval(MalTypePtr ast, EnvPtr env)
+namespace {
+
+size_t eval_stack_limit = size_t(512) << 20;
+size_t eval_stack_usage = 0;  // bytes of frames held by running Evaluators
+
+// the C++ stack nested engines may use, well below the usual 8MB
+constexpr size_t engine_stack_limit = size_t(4) << 20;
+size_t engine_depth = 0;
+const char* engine_stack_base = nullptr;  // where the outermost one entered
+
+bool is_false(const MalTypePtr& value)
 {
-    while (true) {
-        HOOLIB_THROW_UNLESS(ast, "invalid ast");
+    return value->as_nil() || value->as_false();
+}
 
-        // macro expansion
-        ast = macroexpand(ast, env);
+// no need to go through the frames to evaluate these
+bool is_simple(const MalTypePtr& ast)
+{
+    return !ast->as_sequential() && !ast->as_hash_map();
+}
 
-        {
-            // special eval
-            auto ret = mal_eval_special(ast, env);
-            switch (ret.index()) {
-                case 0:
-                    if (auto value = std::get<0>(ret)) return value;
-                    break;
-
-                case 1:
-                    std::tie(ast, env) = std::get<1>(ret);
-                    continue;
-            }
-        }
+// mal_eval keeps its continuation on the heap instead of the C++ stack, so
+// the depth of non-tail recursion is bounded only by eval_stack_limit.
+class Evaluator {
+private:
+    enum class Kind : uint8_t {
+        APPLY,
+        VECTOR,
+        HASH_MAP,
+        IF,
+        DO,
+        LET,
+        DEF,
+        DEFMACRO,
+        TRY,
+        LOOP,
+        RECUR,
+        COND,
+        AND,
+        OR,
+        WHEN,
+        WHEN_NOT
+    };
 
-        auto ast_list = ast->as_list();
-        if (!ast_list) return ast->eval(env);
-        if (ast_list->get().empty()) return ast;
+    struct Frame {
+        Kind kind;
+        uint32_t index;  // next item of ast to evaluate
+        size_t base;     // size of values_ when the frame was pushed
+        MalTypePtr ast;
+        EnvPtr env;
+    };
 
-        ast_list = ast_list->eval(env)->as_list();
-        const auto& list = ast_list->get();
-        auto func = list[0]->as_function();
-        HOOLIB_THROW_UNLESS(func, "invalid list: not function");
+    std::deque<Frame> frames_;
+    std::vector<MalTypePtr> values_;
 
-        return func->call(MalFunction::Args(list.begin() + 1, list.end()));
+public:
+    ~Evaluator() { clear(); }
+
+    MalTypePtr run(MalTypePtr ast, EnvPtr env);
+
+    // drop what an exception left behind
+    void clear()
+    {
+        while (!frames_.empty()) pop();
+        values_.clear();
+    }
+
+private:
+    // Each of these returns the value of the expression, or nullptr after
+    // setting ast and env to what should be evaluated next.
+    MalTypePtr step(MalTypePtr& ast, EnvPtr& env);
+    MalTypePtr resume(MalTypePtr value, MalTypePtr& ast, EnvPtr& env);
+    MalTypePtr advance(MalTypePtr& ast, EnvPtr& env);
+    MalTypePtr apply(MalTypePtr& ast, EnvPtr& env);
+    MalTypePtr recur(MalTypePtr& ast, EnvPtr& env);
+    MalTypePtr arithmetic(const MalList& list, const EnvPtr& env);
+    // Sets ast and env to the handler of the innermost try* for thrown.
+    // false if there is no try* in this evaluator.
+    bool handle(const MalTypePtr& thrown, MalTypePtr& ast, EnvPtr& env);
+
+    void push(Kind kind, MalTypePtr ast, EnvPtr env, uint32_t index = 0)
+    {
+        if (eval_stack_usage + sizeof(Frame) > eval_stack_limit)
+            MAL_THROW_STRING("stack overflow");
+        eval_stack_usage += sizeof(Frame);
+        frames_.push_back(
+            Frame{kind, index, values_.size(), std::move(ast), std::move(env)});
+    }
+
+    void pop()
+    {
+        eval_stack_usage -= sizeof(Frame);
+        frames_.pop_back();
+    }
+};
+
+MalTypePtr Evaluator::run(MalTypePtr ast, EnvPtr env)
+{
+    MalTypePtr value;
+    while (true) {
+        try {
+            while (true) {
+                if (!value)
+                    value = step(ast, env);
+                else if (frames_.empty())
+                    return value;
+                else
+                    value = resume(std::move(value), ast, env);
+            }
+        }
+        catch (mal::Exception& ex) {
+            if (!handle(ex.get(), ast, env)) throw;
+            value = nullptr;
+        }
     }
 }
 
-TCOSwitch mal_eval_special(MalTypePtr ast, EnvPtr env)
+bool Evaluator::handle(const MalTypePtr& thrown, MalTypePtr& ast, EnvPtr& env)
 {
-    auto list = ast->as_list();
-    if (!list || list->get().empty()) return nullptr;
-    auto args = list->get();
-    auto symbol = args[0]->as_symbol();
-    if (!symbol) return nullptr;
-    auto name = symbol->name();
-
-    if (name == "def!") {
-        HOOLIB_THROW_UNLESS(args.size() == 3, "invalid number of argument");
-        auto key_symbol = args[1]->as_symbol();
-        HOOLIB_THROW_UNLESS(key_symbol, "invalid argument");
-        auto value = mal_eval(args[2], env);
-        HOOLIB_THROW_UNLESS(value, "invalid argument");
-        env->set(key_symbol->name(), value);
-        return value;
+    auto it =
+        std::find_if(frames_.rbegin(), frames_.rend(),
+                     [](auto&& frame) { return frame.kind == Kind::TRY; });
+    if (it == frames_.rend()) return false;
+    while (frames_.back().kind != Kind::TRY) pop();
+
+    auto& frame = frames_.back();
+    values_.resize(frame.base);
+    const auto& catch_list = frame.ast->as_list()->get()[2]->as_list();
+    env = mal::make_shared<Env>(frame.env);
+    env->set(catch_list->get()[1]->as_symbol()->name(), thrown);
+    ast = catch_list->get()[2];
+    pop();
+    return true;
+}
+
+MalTypePtr Evaluator::step(MalTypePtr& ast, EnvPtr& env)
+{
+    HOOLIB_THROW_UNLESS(ast, "invalid ast");
+
+    if (auto list = ast->as_list())
+        if (auto value = arithmetic(*list, env)) return value;
+
+    // macro expansion
+    ast = macroexpand(ast, env);
+
+    if (auto vector = ast->as_vector()) {
+        if (vector->get().empty()) return ast->eval(env);
+        push(Kind::VECTOR, ast, env);
+        return advance(ast, env);
     }
 
-    if (name == "defmacro!") {
-        HOOLIB_THROW_UNLESS(args.size() == 3, "invalid number of argument");
-        auto key_symbol = args[1]->as_symbol();
-        HOOLIB_THROW_UNLESS(key_symbol, "invalid argument");
-        auto func = mal_eval(args[2], env)->as_function();
-        HOOLIB_THROW_UNLESS(func, "invalid argument");
-        func->set_macro();
-        env->set(key_symbol->name(), func);
-        return func;
+    if (auto hash = ast->as_hash_map()) {
+        if (hash->data().empty()) return ast->eval(env);
+        push(Kind::HASH_MAP, ast, env);
+        const auto& item = *hash->data().begin();
+        values_.push_back(mal::string(item.first));
+        ast = item.second;
+        return nullptr;
     }
 
-    if (name == "let*") {
-        HOOLIB_THROW_UNLESS(args.size() == 3, "invalid number of argument");
-        auto bindings_src = args[1]->as_sequential();
-        HOOLIB_THROW_UNLESS(bindings_src, "invalid argument");
-        auto bindings = bindings_src->get();
-        HOOLIB_THROW_UNLESS(bindings.size() % 2 == 0, "invalid argument");
+    auto list = ast->as_list();
+    if (!list) return ast->eval(env);
+    const auto& args = list->get();
+    if (args.empty()) return ast;
+
+    // special forms
+    if (auto symbol = args[0]->as_symbol()) {
+        const auto& name = symbol->name();
 
-        auto let_env = mal::make_shared<Env>(env);
-        for (auto it = bindings.begin(); it != bindings.end();) {
-            auto key_symbol = (*it++)->as_symbol();
-            HOOLIB_THROW_UNLESS(key_symbol, "invalid argument");
-            auto value = mal_eval(*it++, let_env);
-            let_env->set(key_symbol->name(), value);
+        if (name == "def!" || name == "defmacro!") {
+            HOOLIB_THROW_UNLESS(args.size() == 3, "invalid number of argument");
+            HOOLIB_THROW_UNLESS(args[1]->as_symbol(), "invalid argument");
+            push(name == "def!" ? Kind::DEF : Kind::DEFMACRO, ast, env);
+            ast = args[2];
+            return nullptr;
         }
 
-        return std::make_tuple(args[2], let_env);
-    }
+        if (name == "let*") {
+            HOOLIB_THROW_UNLESS(args.size() == 3, "invalid number of argument");
+            auto bindings_src = args[1]->as_sequential();
+            HOOLIB_THROW_UNLESS(bindings_src, "invalid argument");
+            const auto& bindings = bindings_src->get();
+            HOOLIB_THROW_UNLESS(bindings.size() % 2 == 0, "invalid argument");
 
-    if (name == "do") {
-        auto size = args.size();
-        if (size == 1) return mal::nil();
-        if (size == 2) return std::make_tuple(args[1], env);
+            env = mal::make_shared<Env>(env);
+            if (bindings.empty()) {
+                ast = args[2];
+                return nullptr;
+            }
+            HOOLIB_THROW_UNLESS(bindings[0]->as_symbol(), "invalid argument");
+            env->set_complete(false);
+            push(Kind::LET, ast, env);
+            ast = bindings[1];
+            return nullptr;
+        }
 
-        auto it = args.begin();
-        auto end = args.end();
-        --end;
-        auto ret = mal::nil();
-        for (; ++it != end;) mal_eval(*it, env);
-        return std::make_tuple(*end, env);
-    }
+        if (name == "loop*") {
+            HOOLIB_THROW_UNLESS(args.size() == 3, "invalid number of argument");
+            auto bindings_src = args[1]->as_sequential();
+            HOOLIB_THROW_UNLESS(bindings_src, "invalid argument");
+            const auto& bindings = bindings_src->get();
+            HOOLIB_THROW_UNLESS(bindings.size() % 2 == 0, "invalid argument");
+            list->check_loop(env);
 
-    if (name == "if") {
-        HOOLIB_THROW_UNLESS(args.size() == 3 || args.size() == 4,
-                            "invalid argument");
-        auto cond = mal_eval(args[1], env);
-        if (cond->as_nil() || cond->as_false()) {  // false
-            if (args.size() == 3) return mal::nil();
-            return std::make_tuple(args[3], env);
-        }
-        // true
-        return std::make_tuple(args[2], env);
-    }
-
-    if (name == "fn*") {
-        HOOLIB_THROW_UNLESS(args.size() == 3, "invalid number of arguments");
-        auto seq = args[1]->as_sequential();
-        HOOLIB_THROW_UNLESS(seq, "invalid argument");
-        const auto& binds_src = seq->get();
-        std::vector<std::string> binds;
-        bool variadic = false;
-        for (auto&& item : binds_src) {
-            auto symbol = item->as_symbol();
-            HOOLIB_THROW_UNLESS(symbol, "invalid argument");
-            if (symbol->name() == "&") {
-                variadic = true;
-                break;
+            // The frame stays while the body runs so that recur can find
+            // the environment to rebind.
+            env = mal::make_shared<Env>(env);
+            push(Kind::LOOP, ast, env);
+            if (bindings.empty()) {
+                ast = args[2];
+                return nullptr;
+            }
+            HOOLIB_THROW_UNLESS(bindings[0]->as_symbol(), "invalid argument");
+            env->set_complete(false);
+            ast = bindings[1];
+            return nullptr;
+        }
+
+        if (name == "recur") {
+            push(Kind::RECUR, ast, env, 1);
+            return advance(ast, env);
+        }
+
+        // cond, and, or, when, when-not, -> and ->> behave like the macros
+        // of the same name, without expanding them every time.
+        if (name == "cond") {
+            if (args.size() == 1) return mal::nil();
+            if (args.size() == 2)
+                MAL_THROW_STRING("odd number of forms to cond");
+            push(Kind::COND, ast, env, 1);
+            ast = args[1];
+            return nullptr;
+        }
+
+        if (name == "and" || name == "or") {
+            if (args.size() == 1) {
+                if (name == "and") return mal::true_();
+                return mal::nil();
             }
-            binds.push_back(symbol->name());
+            if (args.size() > 2)
+                push(name == "and" ? Kind::AND : Kind::OR, ast, env, 1);
+            ast = args[1];
+            return nullptr;
         }
-        if (variadic) {
-            HOOLIB_THROW_UNLESS(binds.size() + 2 == binds_src.size(),
+
+        if (name == "when" || name == "when-not") {
+            HOOLIB_THROW_UNLESS(args.size() >= 2,
+                                "invalid number of arguments");
+            push(name == "when" ? Kind::WHEN : Kind::WHEN_NOT, ast, env);
+            ast = args[1];
+            return nullptr;
+        }
+
+        if (name == "->" || name == "->>") {
+            ast = list->threaded();
+            return nullptr;
+        }
+
+        if (name == "do") {
+            auto size = args.size();
+            if (size == 1) return mal::nil();
+            if (size > 2) push(Kind::DO, ast, env, 1);
+            ast = args[1];
+            return nullptr;
+        }
+
+        if (name == "if") {
+            HOOLIB_THROW_UNLESS(args.size() == 3 || args.size() == 4,
                                 "invalid argument");
-            auto symbol = binds_src.back()->as_symbol();
-            HOOLIB_THROW_UNLESS(symbol, "invalid argument");
-            binds.push_back(symbol->name());
+            push(Kind::IF, ast, env);
+            ast = args[1];
+            return nullptr;
+        }
+
+        if (name == "fn*") {
+            const auto& lambda = list->lambda();
+            auto captured = lambda->capture(env);
+            bool is_sealed = captured != env || !env->outer();
+            return mal::make_shared<MalClosure>(lambda, std::move(captured),
+                                                is_sealed);
+        }
+
+        if (name == "quote") {
+            HOOLIB_THROW_UNLESS(args.size() == 2,
+                                "invalid number of arguments");
+            return args[1];
+        }
+
+        if (name == "quasiquote") {
+            ast = list->quasiquoted();
+            return nullptr;
+        }
+
+        if (name == "macroexpand") {
+            HOOLIB_THROW_UNLESS(args.size() == 2,
+                                "invalid number of arguments");
+            return macroexpand(args[1], env);
         }
 
-        return mal::make_shared<MalFunction>([
-            variadic, binds, outer_env = env, fn_body_ast = args[2]
-        ](auto&& args) {
-            HOOLIB_THROW_UNLESS((variadic && args.size() >= binds.size() - 1) ||
-                                    (!variadic && args.size() == binds.size()),
+        if (name == "try*") {
+            HOOLIB_THROW_UNLESS(args.size() == 3,
+                                "invalid number of arguments");
+            auto catch_list = args[2]->as_list();
+            HOOLIB_THROW_UNLESS(catch_list && catch_list->get().size() == 3,
                                 "invalid argument");
-            auto env = mal::make_shared<Env>(outer_env);
-            for (size_t i = 0; i < (variadic ? binds.size() - 1 : binds.size());
-                 i++)
-                env->set(binds[i], args[i]);
-            if (variadic)
-                env->set(binds.back(),
-                         mal::list(std::vector<MalTypePtr>(
-                             args.begin() + binds.size() - 1, args.end())));
-            return mal_eval(fn_body_ast, env);
-        });
-    }
-
-    if (name == "quote") {
-        HOOLIB_THROW_UNLESS(args.size() == 2, "invalid number of arguments");
-        return args[1];
+            auto catch_symbol = catch_list->get()[0]->as_symbol();
+            HOOLIB_THROW_UNLESS(catch_symbol->name() == "catch*",
+                                "invalid argument");
+            auto excep_bind_symbol = catch_list->get()[1]->as_symbol();
+            HOOLIB_THROW_UNLESS(excep_bind_symbol, "invalid argument");
+            push(Kind::TRY, ast, env);
+            ast = args[1];
+            return nullptr;
+        }
+    }
+
+    // function application
+    if (is_constant_folding)
+        if (auto value = list->fold(env)) return value;
+    if (is_inlining) {
+        if (auto body = list->inlined(env)) {
+            ast = body;
+            return nullptr;
+        }
     }
+    push(Kind::APPLY, ast, env);
+    return advance(ast, env);
+}
+
+MalTypePtr Evaluator::resume(MalTypePtr value, MalTypePtr& ast, EnvPtr& env)
+{
+    auto& frame = frames_.back();
+
+    switch (frame.kind) {
+        case Kind::APPLY:
+        case Kind::VECTOR:
+        case Kind::RECUR:
+            values_.push_back(std::move(value));
+            return advance(ast, env);
+
+        case Kind::HASH_MAP: {
+            values_.push_back(std::move(value));
+            const auto& data = frame.ast->as_hash_map()->data();
+            if (++frame.index == data.size()) {
+                auto hash = mal::hash_map(mal::helper::make_hash_map_container(
+                    values_.begin() + frame.base, values_.end()));
+                values_.resize(frame.base);
+                pop();
+                return hash;
+            }
+            const auto& item = *std::next(data.begin(), frame.index);
+            values_.push_back(mal::string(item.first));
+            ast = item.second;
+            env = frame.env;
+            return nullptr;
+        }
+
+        case Kind::IF: {
+            auto list = std::move(frame.ast);
+            env = std::move(frame.env);
+            pop();
+            const auto& args = list->as_list()->get();
+            if (!is_false(value)) {
+                ast = args[2];
+                return nullptr;
+            }
+            if (args.size() == 3) return mal::nil();
+            ast = args[3];
+            return nullptr;
+        }
+
+        case Kind::DO: {
+            const auto& args = frame.ast->as_list()->get();
+            ast = args[++frame.index];
+            env = frame.env;
+            if (frame.index == args.size() - 1) pop();
+            return nullptr;
+        }
+
+        case Kind::LET: {
+            const auto& args = frame.ast->as_list()->get();
+            const auto& bindings = args[1]->as_sequential()->get();
+            auto key_symbol = bindings[frame.index]->as_symbol();
+            frame.env->set(key_symbol->name(), value);
+            env = frame.env;
+            frame.index += 2;
+            if (frame.index < bindings.size()) {
+                HOOLIB_THROW_UNLESS(bindings[frame.index]->as_symbol(),
+                                    "invalid argument");
+                ast = bindings[frame.index + 1];
+                return nullptr;
+            }
+            frame.env->set_complete(true);
+            ast = args[2];
+            pop();
+            return nullptr;
+        }
+
+        case Kind::DEF: {
+            const auto& args = frame.ast->as_list()->get();
+            frame.env->set(args[1]->as_symbol()->name(), value);
+            pop();
+            return value;
+        }
+
+        case Kind::DEFMACRO: {
+            const auto& args = frame.ast->as_list()->get();
+            // Only closures, so that a builtin is never a macro.
+            auto func = value->as_closure();
+            HOOLIB_THROW_UNLESS(func, "invalid argument");
+            func->set_macro();
+            frame.env->set(args[1]->as_symbol()->name(), func);
+            pop();
+            return func;
+        }
+
+        case Kind::TRY:
+            pop();
+            return value;
+
+        case Kind::COND: {
+            const auto& args = frame.ast->as_list()->get();
+            env = frame.env;
+            if (!is_false(value)) {
+                ast = args[frame.index + 1];
+                pop();
+                return nullptr;
+            }
+            frame.index += 2;
+            if (frame.index == args.size()) {
+                pop();
+                return mal::nil();
+            }
+            if (frame.index + 1 == args.size())
+                MAL_THROW_STRING("odd number of forms to cond");
+            ast = args[frame.index];
+            return nullptr;
+        }
+
+        case Kind::AND:
+        case Kind::OR: {
+            if (is_false(value) == (frame.kind == Kind::AND)) {
+                pop();
+                return value;
+            }
+            const auto& args = frame.ast->as_list()->get();
+            ast = args[++frame.index];
+            env = frame.env;
+            if (frame.index == args.size() - 1) pop();
+            return nullptr;
+        }
+
+        case Kind::WHEN:
+        case Kind::WHEN_NOT: {
+            if (is_false(value) == (frame.kind == Kind::WHEN)) {
+                pop();
+                return mal::nil();
+            }
+            auto list = std::move(frame.ast);
+            env = std::move(frame.env);
+            pop();
+            const auto& args = list->as_list()->get();
+            if (args.size() == 2) return mal::nil();
+            if (args.size() > 3) push(Kind::DO, list, env, 2);
+            ast = args[2];
+            return nullptr;
+        }
 
-    if (name == "quasiquote") {
-        HOOLIB_THROW_UNLESS(args.size() == 2, "invalid number of arguments");
-        return std::make_tuple(quasiquote(args[1]), env);
+        case Kind::LOOP: {
+            const auto& args = frame.ast->as_list()->get();
+            const auto& bindings = args[1]->as_sequential()->get();
+            if (frame.index == bindings.size()) {  // the body is done
+                pop();
+                return value;
+            }
+            auto key_symbol = bindings[frame.index]->as_symbol();
+            frame.env->set(key_symbol->name(), value);
+            env = frame.env;
+            frame.index += 2;
+            if (frame.index < bindings.size()) {
+                HOOLIB_THROW_UNLESS(bindings[frame.index]->as_symbol(),
+                                    "invalid argument");
+                ast = bindings[frame.index + 1];
+                return nullptr;
+            }
+            frame.env->set_complete(true);
+            ast = args[2];
+            return nullptr;
+        }
     }
 
-    if (name == "macroexpand") {
-        HOOLIB_THROW_UNLESS(args.size() == 2, "invalid number of arguments");
-        return macroexpand(args[1], env);
+    return value;
+}
+
+// evaluate the rest of the items of an APPLY or VECTOR frame
+MalTypePtr Evaluator::advance(MalTypePtr& ast, EnvPtr& env)
+{
+    auto& frame = frames_.back();
+    const auto& items = frame.ast->as_sequential()->get();
+    while (frame.index < items.size()) {
+        const auto& item = items[frame.index++];
+        if (!is_simple(item)) {
+            ast = item;
+            env = frame.env;
+            return nullptr;
+        }
+        values_.push_back(item->eval(frame.env));
     }
 
-    if (name == "try*") {
-        HOOLIB_THROW_UNLESS(args.size() == 3, "invalid number of arguments");
-        auto catch_list = (*(args.end() - 1))->as_list();
-        HOOLIB_THROW_UNLESS(catch_list && catch_list->get().size() == 3,
-                            "invalid argument");
-        auto catch_symbol = catch_list->get()[0]->as_symbol();
-        HOOLIB_THROW_UNLESS(catch_symbol->name() == "catch*",
-                            "invalid argument");
-        auto excep_bind_symbol = catch_list->get()[1]->as_symbol();
-        HOOLIB_THROW_UNLESS(excep_bind_symbol, "invalid argument");
-        try {
-            auto res = mal_eval(args[1], env);
-            return res;
+    if (frame.kind == Kind::APPLY) return apply(ast, env);
+    if (frame.kind == Kind::RECUR) return recur(ast, env);
+
+    auto vector = mal::vector(
+        std::vector<MalTypePtr>(values_.begin() + frame.base, values_.end()));
+    values_.resize(frame.base);
+    pop();
+    return vector;
+}
+
+MalTypePtr Evaluator::apply(MalTypePtr& ast, EnvPtr& env)
+{
+    auto base = frames_.back().base;
+    const auto& callee = values_[base];
+    MalFunction::Args args(values_.data() + base + 1,
+                           values_.data() + values_.size());
+
+    // APPLY frames are pushed only for lists
+    auto& site = static_cast<const MalList&>(*frames_.back().ast).call_site();
+    bool hit = site.is(callee.get());
+    HOOLIB_THROW_UNLESS(hit || site.update(callee),
+                        "invalid list: not function");
+    site.count(hit);
+
+    auto func = site.function();
+    auto kind = site.kind();
+    if (kind == MalCallSite::Kind::ARITHMETIC) {
+        auto value = static_cast<const MalArithmetic&>(*func).apply(args);
+        values_.resize(base);
+        pop();
+        return value;
+    }
+    if (kind == MalCallSite::Kind::THROW) {
+        HOOLIB_THROW_UNLESS(args.size() == 1, "invalid number of arguments");
+        auto thrown = args[0];
+        if (!handle(thrown, ast, env)) MAL_THROW(thrown);
+        return nullptr;
+    }
+    std::shared_ptr<MalFunction> unwrapped;
+    std::vector<MalTypePtr> applied;
+    if (kind == MalCallSite::Kind::APPLY) {
+        unwrapped = func->as_function();
+        while (unwrapped->is_apply()) {
+            std::tie(unwrapped, applied) = mal::helper::apply_args(args);
+            args = MalFunction::Args(applied);
         }
-        catch (mal::Exception ex) {
-            auto new_env = mal::make_shared<Env>(env);
-            new_env->set(excep_bind_symbol->name(), ex.get());
-            return mal_eval(catch_list->get()[2], new_env);
+        func = unwrapped.get();
+        kind = func->as_closure() ? MalCallSite::Kind::CLOSURE
+                                  : MalCallSite::Kind::BUILTIN;
+    }
+
+    if (kind == MalCallSite::Kind::CLOSURE) {
+        auto& closure = static_cast<MalClosure&>(*func);
+        if (auto tiered = tier_up(closure)) {
+            if (auto value = tiered->try_callN(args)) {
+                values_.resize(base);
+                pop();
+                return value;
+            }
         }
+        // In a tail call nothing refers to the caller's environment any
+        // more, so the callee can take it over.
+        env = nullptr;
+        env = closure.make_env(args, std::move(frames_.back().env));
+        ast = closure.body();
+        values_.resize(base);
+        pop();
+        return nullptr;
     }
 
+    auto value = func->callN(args);
+    values_.resize(base);
+    pop();
+    return value;
+}
+
+// The value of list as a call to a MalArithmetic the call site has seen
+// before, computed without a frame, or nullptr. Only variables and constants
+// are accepted as the arguments.
+MalTypePtr Evaluator::arithmetic(const MalList& list, const EnvPtr& env)
+{
+    auto site = list.call_site_if();
+    if (!site || site->kind() != MalCallSite::Kind::ARITHMETIC) return nullptr;
+    const auto& items = list.get();
+    if (items.size() > 3 || typeid(*items[0]) != typeid(MalSymbol))
+        return nullptr;
+    for (size_t i = 1; i < items.size(); i++)
+        if (!is_simple(items[i])) return nullptr;
+
+    // The site is updated only in apply(), so the head isn't a special form.
+    // Nor is it a macro, since defmacro! doesn't take builtins.
+    auto head = env->get_if(static_cast<const MalSymbol&>(*items[0]).name());
+    if (!site->is(head.get())) return nullptr;
+    site->count(true);
+    MalTypePtr args[2];
+    for (size_t i = 1; i < items.size(); i++) args[i - 1] = items[i]->eval(env);
+    return static_cast<const MalArithmetic&>(*site->function())
+        .apply(MalFunction::Args(args, args + items.size() - 1));
+}
+
+MalTypePtr Evaluator::recur(MalTypePtr& ast, EnvPtr& env)
+{
+    auto base = frames_.back().base;
+    auto recur_env = std::move(frames_.back().env);
+    pop();
+
+    // check_loop() has made sure that the loop* frame is right below, unless
+    // recur is in a function called from the loop. Then recur_env isn't
+    // inside the loop's one.
+    HOOLIB_THROW_UNLESS(!frames_.empty() && frames_.back().kind == Kind::LOOP,
+                        "recur outside loop*");
+    auto& frame = frames_.back();
+    auto inner = recur_env.get();
+    while (inner && inner != frame.env.get()) inner = inner->outer().get();
+    HOOLIB_THROW_UNLESS(inner, "recur outside loop*");
+    recur_env = nullptr;
+
+    const auto& args = frame.ast->as_list()->get();
+    const auto& bindings = args[1]->as_sequential()->get();
+    HOOLIB_THROW_UNLESS(values_.size() - base == bindings.size() / 2,
+                        "invalid number of arguments");
+
+    // The bindings are updated in place unless a closure has kept the
+    // environment of the previous iteration.
+    env = nullptr;
+    if (frame.env.use_count() != 1) {
+        frame.env = mal::make_shared<Env>(frame.env->outer());
+        frame.env->reserve(bindings.size() / 2);
+    }
+    for (size_t i = 0; i < bindings.size(); i += 2)
+        frame.env->set(bindings[i]->as_symbol()->name(),
+                       std::move(values_[base + i / 2]));
+    values_.resize(base);
+
+    env = frame.env;
+    ast = args[2];
     return nullptr;
 }
 
+}  // namespace
+
+namespace mal {
+void set_stack_limit(size_t bytes) { eval_stack_limit = bytes; }
+size_t stack_limit() { return eval_stack_limit; }
+void set_constant_folding(bool is_on) { is_constant_folding = is_on; }
+bool constant_folding() { return is_constant_folding; }
+void set_inlining(bool is_on) { is_inlining = is_on; }
+bool inlining() { return is_inlining; }
+
+EngineEntry::EngineEntry()
+{
+    char here;
+    if (engine_depth == 0)
+        engine_stack_base = &here;
+    else if (static_cast<size_t>(engine_stack_base - &here) >
+             engine_stack_limit)
+        MAL_THROW_STRING("stack overflow");
+    engine_depth++;
+}
+
+EngineEntry::~EngineEntry() { engine_depth--; }
+
+size_t EngineEntry::depth() { return engine_depth; }
+
+void set_tier_up(uint32_t threshold, TierUpHook hook)
+{
+    tiering_threshold = hook ? threshold : 0;
+    tiering_hook = hook;
+}
+uint32_t tier_up_threshold() { return tiering_threshold; }
+
+std::vector<const MalCallSite*> call_sites()
+{
+    const auto& sites = call_site_registry();
+    return std::vector<const MalCallSite*>(sites.begin(), sites.end());
+}
+}  // namespace mal
+
+MalTypePtr mal_eval(MalTypePtr ast, EnvPtr env)
+{
+    mal::EngineEntry entry;
+
+    // Evaluators are reused, so that e.g. map calling a closure for each
+    // item doesn't allocate the stacks again.
+    static std::vector<std::unique_ptr<Evaluator>> pool;
+
+    std::unique_ptr<Evaluator> evaluator;
+    if (pool.empty()) {
+        evaluator = std::make_unique<Evaluator>();
+    }
+    else {
+        evaluator = std::move(pool.back());
+        pool.pop_back();
+    }
+
+    struct Release {
+        std::unique_ptr<Evaluator>& evaluator;
+        ~Release()
+        {
+            evaluator->clear();
+            pool.push_back(std::move(evaluator));
+        }
+    } release{evaluator};
+
+    return evaluator->run(std::move(ast), std::move(env));
+}
+
+namespace {
+bool has_unquote(const MalTypePtr& ast)
+{
+    if (!mal::helper::is_pair(ast)) return false;
+    const auto& items = ast->as_sequential()->get();
+    if (auto symbol = items[0]->as_symbol())
+        if (symbol->name() == "unquote" || symbol->name() == "splice-unquote")
+            return true;
+    return std::any_of(items.begin(), items.end(), has_unquote);
+}
+
+// what quasiquote makes of a template without unquote
+MalTypePtr as_constant(const MalTypePtr& ast)
+{
+    if (!mal::helper::is_pair(ast)) return ast;
+    std::vector<MalTypePtr> items;
+    for (auto&& item : ast->as_sequential()->get())
+        items.push_back(as_constant(item));
+    return mal::list(items);
+}
+}  // namespace
+
 MalTypePtr quasiquote(const MalTypePtr& ast)
 {
-    if (!mal::helper::is_pair(ast))
-        return mal::list({mal::symbol("quote"), ast});
+    // Parts without unquote are quoted as a whole, so that they are shared
+    // instead of being built by cons every time.
+    if (!has_unquote(ast))
+        return mal::list({mal::symbol("quote"), as_constant(ast)});
 
     auto ast_seq = ast->as_sequential()->get();
     if (auto symbol = ast_seq[0]->as_symbol()) {
@@ -276,25 +1595,36 @@ MalTypePtr quasiquote(const MalTypePtr& ast)
                       quasiquote(mal::list(list))});
 }
 
-bool is_macro_call(const MalTypePtr& ast, const EnvPtr& env)
+// The macro ast calls, or nullptr. The call site of ast is consulted but
+// left as it is, since most calls are not macro calls and
+// Evaluator::apply() takes care of them.
+MalTypePtr called_macro(const MalTypePtr& ast, const EnvPtr& env)
 {
     auto list = ast->as_list();
-    if (!list || list->get().empty()) return false;
+    if (!list || list->get().empty()) return nullptr;
     auto symbol = list->get()[0]->as_symbol();
-    if (!symbol) return false;
+    if (!symbol) return nullptr;
     auto func_src = env->get_if(symbol->name());
-    if (!func_src) return false;
+    if (!func_src) return nullptr;
+    auto& site = list->call_site();
+    if (site.is(func_src.get()))
+        return site.function()->is_macro() ? func_src : nullptr;
     auto func = func_src->as_function();
-    if (!func) return false;
-    return func->is_macro();
+    if (!func || !func->is_macro()) return nullptr;
+    return func_src;
 }
 
 MalTypePtr macroexpand(MalTypePtr ast, const EnvPtr& env)
 {
-    while (is_macro_call(ast, env)) {
-        auto list = ast->as_list()->get();
-        auto func = env->get(list[0]->as_symbol()->name())->as_function();
-        ast = func->call(MalFunction::Args(list.begin() + 1, list.end()));
+    while (auto macro = called_macro(ast, env)) {
+        auto list = ast->as_list();
+        auto& site = list->call_site();
+        bool hit = site.is(macro.get());
+        if (!hit) site.update(macro);
+        site.count(hit);
+        const auto& items = list->get();
+        ast = site.function()->callN(
+            MalFunction::Args(items.data() + 1, items.data() + items.size()));
     }
 
     return ast;
@@ -307,15 +1637,362 @@ MalTypePtr MalHashMap::eval(EnvPtr env)
     return mal::hash_map(std::move(ret_src));
 }
 
-std::string MalHashMap::pr_str(bool print_readably) const
+void MalHashMap::print(std::string& out, bool print_readably) const
+{
+    out += '{';
+    bool first = true;
+    for (auto&& [key, value] : data_) {
+        if (!first) out += ' ';
+        first = false;
+        MalString::print(out, key, print_readably);
+        out += ' ';
+        value->print(out, print_readably);
+    }
+    out += '}';
+}
+
+MalLazySeq::MalLazySeq(Step step)
+    : cell_(std::make_shared<Cell>()), offset_(0)
+{
+    cell_->step = std::move(step);
+}
+
+MalLazySeq::Cell::~Cell()
+{
+    // The chunks computed after this one are released a cell at a time,
+    // since releasing them recursively would overflow the C++ stack for a
+    // long seq.
+    auto more = std::move(chunk.more);
+    while (more && more.use_count() == 1 && more->cell_.use_count() == 1)
+        more = std::move(more->cell_->chunk.more);
+}
+
+const MalLazySeq::Chunk& MalLazySeq::chunk() const
+{
+    auto& cell = *cell_;
+    if (!cell.step) return cell.chunk;
+
+    auto step = std::move(cell.step);
+    cell.step = nullptr;
+    Chunk chunk;
+    try {
+        chunk = step();
+    }
+    catch (...) {
+        cell.step = std::move(step);
+        throw;
+    }
+    // only the end may have no items
+    while (chunk.items.empty() && chunk.more) {
+        auto more = std::move(chunk.more);
+        const auto& next = more->chunk();
+        chunk.items.assign(next.items.begin() + more->offset_,
+                           next.items.end());
+        chunk.more = next.more;
+    }
+    cell.chunk = std::move(chunk);
+    return cell.chunk;
+}
+
+MalTypePtr MalLazySeq::first() const
+{
+    if (empty()) return mal::nil();
+    return chunk().items[offset_];
+}
+
+std::shared_ptr<MalLazySeq> MalLazySeq::rest() const
+{
+    const auto& chunk = this->chunk();
+    if (offset_ + 1 < chunk.items.size())
+        return mal::make_shared<MalLazySeq>(cell_, offset_ + 1);
+    if (chunk.more) return chunk.more;
+    return mal::lazy::seq(mal::nil());
+}
+
+void MalLazySeq::print(std::string& out, bool print_readably) const
+{
+    out += '(';
+    bool first = true;
+    each([&](auto&& item) {
+        if (!first) out += ' ';
+        first = false;
+        item->print(out, print_readably);
+        return true;
+    });
+    out += ')';
+}
+
+bool MalLazySeq::is_equal_to(const MalTypePtr& rhs) const
+{
+    if (auto seq = rhs->as_sequential()) return equals(seq->get());
+    auto other = rhs->as_lazy_seq();
+    if (!other) return false;
+    std::shared_ptr<const MalLazySeq> lhs = get_this_pointer();
+    while (!lhs->empty() && !other->empty()) {
+        if (!lhs->first()->is_equal_to(other->first())) return false;
+        lhs = lhs->rest();
+        other = other->rest();
+    }
+    return lhs->empty() && other->empty();
+}
+
+bool MalLazySeq::equals(const std::vector<MalTypePtr>& items) const
+{
+    size_t i = 0;
+    bool is_equal = true;
+    each([&](auto&& item) {
+        is_equal = i < items.size() && item->is_equal_to(items[i++]);
+        return is_equal;
+    });
+    return is_equal && i == items.size();
+}
+
+namespace {
+using Chunk = MalLazySeq::Chunk;
+
+std::shared_ptr<MalLazySeq> make_lazy(MalLazySeq::Step step)
+{
+    return mal::make_shared<MalLazySeq>(std::move(step));
+}
+
+// the items of seq from pos
+std::shared_ptr<MalLazySeq> items_from(std::shared_ptr<MalSequential> seq,
+                                       size_t pos)
+{
+    return make_lazy([seq, pos] {
+        const auto& items = seq->get();
+        auto end = std::min(items.size(), pos + MalLazySeq::CHUNK_SIZE);
+        Chunk chunk;
+        chunk.items.assign(items.begin() + pos, items.begin() + end);
+        if (end < items.size()) chunk.more = items_from(seq, end);
+        return chunk;
+    });
+}
+
+// the items of seq's first chunk that belong to seq, and the rest
+Chunk remaining(const MalLazySeq& seq)
+{
+    const auto& chunk = seq.chunk();
+    return {std::vector<MalTypePtr>(chunk.items.begin() + seq.offset(),
+                                    chunk.items.end()),
+            chunk.more};
+}
+
+// x (if with_x) and then (func x), (func (func x)), ...
+std::shared_ptr<MalLazySeq> iterate_from(std::shared_ptr<MalFunction> func,
+                                         MalTypePtr x, bool with_x)
+{
+    return make_lazy([func, x, with_x] {
+        Chunk chunk;
+        auto value = x;
+        if (with_x) chunk.items.push_back(value);
+        while (chunk.items.size() < MalLazySeq::CHUNK_SIZE) {
+            value = func->call1(value);
+            chunk.items.push_back(value);
+        }
+        chunk.more = iterate_from(func, value, false);
+        return chunk;
+    });
+}
+
+// Items of source that come out of pass. The chunks are computed in order,
+// so they can share pass.
+std::shared_ptr<MalLazySeq> passed(
+    std::shared_ptr<MalTransducer::Pass> pass,
+    std::shared_ptr<MalLazySeq> source)
+{
+    return make_lazy([pass, source] {
+        // up to the first chunk of source with an item that comes out
+        Chunk chunk;
+        auto rest = source;
+        while (rest && chunk.items.empty() && !pass->done()) {
+            auto next = remaining(*rest);
+            for (auto&& item : next.items) {
+                if (auto out = pass->step(item))
+                    chunk.items.push_back(std::move(out));
+                if (pass->done()) break;
+            }
+            rest = next.more;
+        }
+        if (rest && !pass->done()) chunk.more = passed(pass, rest);
+        return chunk;
+    });
+}
+
+// (filter pred coll) and so on as a seq
+std::shared_ptr<MalLazySeq> xform_seq(MalTransducer::Stage::Kind kind,
+                                      std::shared_ptr<MalFunction> pred,
+                                      const MalTypePtr& coll)
+{
+    auto xform = mal::make_shared<MalTransducer>(
+        std::vector<MalTransducer::Stage>{{kind, std::move(pred), 0}});
+    return xform->sequence(coll);
+}
+}  // namespace
+
+namespace mal::lazy {
+std::shared_ptr<MalLazySeq> seq(const MalTypePtr& coll)
+{
+    if (auto lazy_seq = coll->as_lazy_seq()) return lazy_seq;
+    if (auto items = coll->as_sequential()) return items_from(items, 0);
+    HOOLIB_THROW_UNLESS(coll->as_nil(), "invalid argument");
+    return make_lazy([] { return Chunk(); });
+}
+
+std::shared_ptr<MalLazySeq> from_thunk(std::shared_ptr<MalFunction> thunk)
+{
+    return make_lazy([thunk] {
+        auto items = thunk->callN(MalFunction::Args(nullptr, nullptr));
+        return remaining(*seq(items));
+    });
+}
+
+std::shared_ptr<MalLazySeq> cons(MalTypePtr head,
+                                 std::shared_ptr<MalLazySeq> coll)
 {
-    // FIXME: too slow(?)
-    std::vector<std::string> strs;
-    for (auto&& item : data_) {
-        std::stringstream ss;
-        ss << mal::string(item.first)->pr_str(print_readably) << " "
-           << item.second->pr_str(print_readably);
-        strs.push_back(ss.str());
+    return make_lazy([head, coll] { return Chunk{{head}, coll}; });
+}
+
+std::shared_ptr<MalLazySeq> range(long long int start,
+                                  std::optional<long long int> end,
+                                  long long int step)
+{
+    return make_lazy([start, end, step] {
+        auto in_range = [&](long long int i) {
+            return !end || (step >= 0 ? i < *end : i > *end);
+        };
+        Chunk chunk;
+        auto i = start;
+        for (; chunk.items.size() < MalLazySeq::CHUNK_SIZE && in_range(i);
+             i += step)
+            chunk.items.push_back(mal::int_(i));
+        if (in_range(i)) chunk.more = range(i, end, step);
+        return chunk;
+    });
+}
+
+std::shared_ptr<MalLazySeq> map(std::shared_ptr<MalFunction> func,
+                                const MalTypePtr& coll)
+{
+    return make_lazy([func, source = seq(coll)] {
+        auto chunk = remaining(*source);
+        for (auto&& item : chunk.items) item = func->call1(item);
+        if (chunk.more) chunk.more = map(func, chunk.more);
+        return chunk;
+    });
+}
+
+std::shared_ptr<MalLazySeq> filter(std::shared_ptr<MalFunction> pred,
+                                   const MalTypePtr& coll)
+{
+    return xform_seq(MalTransducer::Stage::Kind::FILTER, std::move(pred), coll);
+}
+
+std::shared_ptr<MalLazySeq> remove(std::shared_ptr<MalFunction> pred,
+                                   const MalTypePtr& coll)
+{
+    return xform_seq(MalTransducer::Stage::Kind::REMOVE, std::move(pred), coll);
+}
+
+std::shared_ptr<MalLazySeq> take(long long int n, const MalTypePtr& coll)
+{
+    if (n <= 0) return seq(mal::nil());
+    return make_lazy([n, source = seq(coll)] {
+        auto chunk = remaining(*source);
+        if (chunk.items.size() >= static_cast<size_t>(n)) {
+            chunk.items.resize(n);
+            chunk.more = nullptr;
+        }
+        else if (chunk.more) {
+            chunk.more = take(n - chunk.items.size(), chunk.more);
+        }
+        return chunk;
+    });
+}
+
+std::shared_ptr<MalLazySeq> drop(long long int n, const MalTypePtr& coll)
+{
+    return make_lazy([n, source = seq(coll)] {
+        auto left = static_cast<size_t>(std::max(n, 0LL));
+        for (auto rest = source;;) {
+            auto chunk = remaining(*rest);
+            if (left < chunk.items.size() || !chunk.more) {
+                chunk.items.erase(
+                    chunk.items.begin(),
+                    chunk.items.begin() + std::min(left, chunk.items.size()));
+                return chunk;
+            }
+            left -= chunk.items.size();
+            rest = chunk.more;
+        }
+    });
+}
+
+std::shared_ptr<MalLazySeq> iterate(std::shared_ptr<MalFunction> func,
+                                    MalTypePtr x)
+{
+    return iterate_from(std::move(func), std::move(x), true);
+}
+}  // namespace mal::lazy
+
+MalTransducer::Pass::Pass(std::shared_ptr<const MalTransducer> xform)
+    : xform_(std::move(xform)), left_(xform_->stages_.size()), done_(false)
+{
+    for (size_t i = 0; i < left_.size(); i++) left_[i] = xform_->stages_[i].n;
+}
+
+MalTypePtr MalTransducer::Pass::step(MalTypePtr item)
+{
+    using Kind = Stage::Kind;
+    const auto& stages = xform_->stages_;
+    for (size_t i = 0; i < stages.size(); i++) {
+        const auto& stage = stages[i];
+        switch (stage.kind) {
+        case Kind::MAP:
+            item = stage.func->call1(item);
+            break;
+        case Kind::FILTER:
+            if (is_false(stage.func->call1(item))) return nullptr;
+            break;
+        case Kind::REMOVE:
+            if (!is_false(stage.func->call1(item))) return nullptr;
+            break;
+        case Kind::TAKE:
+            if (left_[i] <= 0) {
+                done_ = true;
+                return nullptr;
+            }
+            // nothing passes after the last one
+            if (--left_[i] == 0) done_ = true;
+            break;
+        }
     }
-    return "{" + HooLib::join(HOOLIB_RANGE(strs), " ") + "}";
+    return item;
+}
+
+void MalTransducer::each(
+    const MalTypePtr& coll,
+    const std::function<void(const MalTypePtr&)>& out) const
+{
+    Pass pass(get_this_pointer());
+    auto push = [&](const MalTypePtr& item) {
+        if (auto value = pass.step(item)) out(value);
+        return !pass.done();
+    };
+    if (auto lazy_seq = coll->as_lazy_seq()) {
+        lazy_seq->each(push);
+        return;
+    }
+    if (coll->as_nil()) return;
+    auto seq = coll->as_sequential();
+    HOOLIB_THROW_UNLESS(seq, "invalid argument");
+    for (auto&& item : seq->get())
+        if (!push(item)) break;
+}
+
+std::shared_ptr<MalLazySeq> MalTransducer::sequence(
+    const MalTypePtr& coll) const
+{
+    return passed(std::make_shared<Pass>(get_this_pointer()),
+                  mal::lazy::seq(coll));
 }
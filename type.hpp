@@ -2,9 +2,13 @@
 #ifndef MAL_TYPE_HPP
 #define MAL_TYPE_HPP
 
+#include <atomic>
+#include <functional>
 #include <memory>
+#include <optional>
+#include <string_view>
 #include <unordered_map>
-#include <variant>
+#include <utility>
 #include "hoolib.hpp"
 
 class MalType;
@@ -14,6 +18,7 @@ using MalTypePtr = std::shared_ptr<MalType>;
 #include "env.hpp"
 
 class MalFunction;
+class MalClosure;
 class MalInteger;
 class MalAtom;
 class MalSymbol;
@@ -21,10 +26,15 @@ class MalNil;
 class MalTrue;
 class MalFalse;
 class MalString;
+class MalStringBuilder;
 class MalSequential;
 class MalList;
 class MalVector;
 class MalHashMap;
+class MalLazySeq;
+class MalTransducer;
+struct MalFolding;
+struct MalInlining;
 
 #define MAL_DEFINE_AS_BASE(classname, typename)                            \
 public:                                                                    \
@@ -40,20 +50,32 @@ public:
 
     virtual MalTypePtr eval(EnvPtr env) = 0;
 
-    virtual std::string pr_str(bool print_readably) const = 0;
+    // Appends the printed form to out. Everything printed goes into one
+    // buffer, so nested values aren't copied at every level.
+    virtual void print(std::string& out, bool print_readably) const = 0;
+    std::string pr_str(bool print_readably) const
+    {
+        std::string out;
+        print(out, print_readably);
+        return out;
+    }
 
     MAL_DEFINE_AS_BASE(MalInteger, integer);
     MAL_DEFINE_AS_BASE(MalFunction, function);
+    MAL_DEFINE_AS_BASE(MalClosure, closure);
     MAL_DEFINE_AS_BASE(MalAtom, atom);
     MAL_DEFINE_AS_BASE(MalSymbol, symbol);
     MAL_DEFINE_AS_BASE(MalNil, nil);
     MAL_DEFINE_AS_BASE(MalTrue, true);
     MAL_DEFINE_AS_BASE(MalFalse, false);
     MAL_DEFINE_AS_BASE(MalString, string);
+    MAL_DEFINE_AS_BASE(MalStringBuilder, string_builder);
     MAL_DEFINE_AS_BASE(MalSequential, sequential);
     MAL_DEFINE_AS_BASE(MalList, list);
     MAL_DEFINE_AS_BASE(MalVector, vector);
     MAL_DEFINE_AS_BASE(MalHashMap, hash_map);
+    MAL_DEFINE_AS_BASE(MalLazySeq, lazy_seq);
+    MAL_DEFINE_AS_BASE(MalTransducer, transducer);
 
     virtual bool is_equal_to(const MalTypePtr& rhs) const
     {
@@ -89,26 +111,180 @@ class MalFunction : public MalType {
     MAL_DEFINE_AS(MalFunction, function);
 
 public:
-    using Args = HooLib::Range<std::vector<MalTypePtr>::const_iterator>;
+    // arguments are contiguous, e.g. a part of a std::vector or an array
+    class Args : public HooLib::Range<const MalTypePtr*> {
+    public:
+        using Range::Range;
+        Args(const std::vector<MalTypePtr>& items)
+            : Range(items.data(), items.data() + items.size())
+        {
+        }
+    };
     using Func = std::function<MalTypePtr(const Args&)>;
 
 private:
     Func func_;
-    bool is_macro_;
+    bool is_macro_, is_apply_, is_pure_, is_throw_;
+
+protected:
+    MalFunction()
+        : is_macro_(false), is_apply_(false), is_pure_(false), is_throw_(false)
+    {
+    }
 
 public:
-    MalFunction(Func func) : func_(func), is_macro_(false) {}
+    MalFunction(Func func)
+        : func_(func),
+          is_macro_(false),
+          is_apply_(false),
+          is_pure_(false),
+          is_throw_(false)
+    {
+    }
 
     void set_macro(bool is_on = true) { is_macro_ = is_on; }
     bool is_macro() const { return is_macro_; }
 
-    MalTypePtr call(const Args& args) { return func_(args); }
-    MalTypePtr eval(EnvPtr env)
+    // mal_eval unwraps a call to apply so that its callee stays in tail
+    // position. See mal::helper::apply_args for the argument layout.
+    void set_apply(bool is_on = true) { is_apply_ = is_on; }
+    bool is_apply() const { return is_apply_; }
+
+    // A pure function depends on nothing but its arguments and has no side
+    // effects, so that a call with constant arguments can be evaluated in
+    // advance. See MalList::fold().
+    void set_pure(bool is_on = true) { is_pure_ = is_on; }
+    bool is_pure() const { return is_pure_; }
+
+    // mal_eval and the VM pass what throw is called with straight to the
+    // innermost try* they are running, without unwinding the C++ stack.
+    // Only where there is none is it thrown as mal::Exception.
+    void set_throw(bool is_on = true) { is_throw_ = is_on; }
+    bool is_throw() const { return is_throw_; }
+
+    // Entry points by the number of arguments. Builtins of fixed arity
+    // (MalBuiltin) override call1 and call2, so that callers with one or two
+    // arguments at hand don't need to line them up.
+    virtual MalTypePtr callN(const Args& args) { return func_(args); }
+    virtual MalTypePtr call1(const MalTypePtr& arg)
+    {
+        return callN(Args(&arg, &arg + 1));
+    }
+    virtual MalTypePtr call2(const MalTypePtr& lhs, const MalTypePtr& rhs)
+    {
+        const MalTypePtr args[] = {lhs, rhs};
+        return callN(Args(args, args + 2));
+    }
+
+    // callN() of the faster form of a closure (MalClosure::tiered()), or
+    // nullptr if it can't take these arguments. The caller then evaluates
+    // the closure's body itself, e.g. in the loop of mal_eval, so that tail
+    // calls stay there.
+    virtual MalTypePtr try_callN(const Args& args) { return callN(args); }
+
+    // A function in an AST stands for itself. MalList::inlined() puts
+    // builtins there.
+    MalTypePtr eval(EnvPtr env) { return get_this_pointer(); }
+
+    void print(std::string& out, bool print_readably) const
+    {
+        out += "#<function>";
+    }
+};
+
+// parameters and body of a fn* form. It's worked out once per form and
+// shared by every closure the form creates; see MalList::lambda().
+class MalLambda {
+public:
+    struct FreeVariable {
+        std::string name;
+        bool is_called;  // appears at the head of a list
+    };
+
+private:
+    std::vector<std::string> params_;
+    bool variadic_;
+    MalTypePtr body_;
+    // nullopt if the body can't be analyzed, e.g. it has def!
+    std::optional<std::vector<FreeVariable>> free_;
+
+public:
+    MalLambda(std::vector<std::string> params, bool variadic, MalTypePtr body);
+
+    const std::vector<std::string>& params() const { return params_; }
+    bool is_variadic() const { return variadic_; }
+    size_t nfixed() const { return params_.size() - (variadic_ ? 1 : 0); }
+    const MalTypePtr& body() const { return body_; }
+
+    // The environment a closure of this lambda keeps. Instead of the whole
+    // chain of env it's a copy of the local bindings the body refers to, so
+    // that the rest can be freed. env is returned as is if any of the free
+    // variables isn't bound yet or names a macro, or a let* in the chain is
+    // still binding, since then the body may refer to something else later.
+    EnvPtr capture(const EnvPtr& env) const;
+};
+using MalLambdaPtr = std::shared_ptr<const MalLambda>;
+
+// function created by fn*. mal_eval runs its body in its own loop instead of
+// going through callN(), so tail calls don't grow the C++ stack.
+class MalClosure : public MalFunction {
+    MAL_DEFINE_GET_THIS_PTR(MalClosure);
+    MAL_DEFINE_AS(MalClosure, closure);
+
+private:
+    MalLambdaPtr lambda_;
+    EnvPtr env_;
+    bool is_sealed_;
+    uint32_t calls_ = 0;
+    std::shared_ptr<MalFunction> tiered_;
+    std::atomic<bool> is_tiered_ = false;
+
+public:
+    MalClosure(MalLambdaPtr lambda, EnvPtr env, bool is_sealed = false)
+        : lambda_(std::move(lambda)),
+          env_(std::move(env)),
+          is_sealed_(is_sealed)
+    {
+    }
+
+    const std::vector<std::string>& params() const { return lambda_->params(); }
+    bool is_variadic() const { return lambda_->is_variadic(); }
+    const MalTypePtr& body() const { return lambda_->body(); }
+    const EnvPtr& env() const { return env_; }
+
+    // whether env() is the root environment or one made by
+    // MalLambda::capture(), neither of which gets new bindings that shadow
+    // what the body has seen
+    bool is_sealed() const { return is_sealed_; }
+
+    // Tiered execution. mal_eval counts the calls and passes the closure to
+    // the tier-up hook once it gets hot (see mal::set_tier_up). The hook may
+    // then set a faster form to be called instead, from another thread.
+    uint32_t count_call()
     {
-        HOOLIB_THROW("MalFunction couldn't be evaluated");
+        if (calls_ != UINT32_MAX) calls_++;
+        return calls_;
     }
+    MalFunction* tiered() const
+    {
+        return is_tiered_.load(std::memory_order_acquire) ? tiered_.get()
+                                                           : nullptr;
+    }
+    // only once
+    void set_tiered(std::shared_ptr<MalFunction> func)
+    {
+        tiered_ = std::move(func);
+        is_tiered_.store(true, std::memory_order_release);
+    }
+    // back to mal_eval for good, when the faster form gives up. It's kept
+    // alive since it may be running.
+    void drop_tiered() { is_tiered_.store(false, std::memory_order_release); }
+
+    // reusable is taken over instead of allocating a new environment if
+    // it's an unshared environment created by this closure.
+    EnvPtr make_env(const Args& args, EnvPtr reusable = nullptr) const;
 
-    std::string pr_str(bool print_readably) const { return "#<function>"; }
+    MalTypePtr callN(const Args& args) override;
 };
 
 class MalAtom : public MalType {
@@ -125,7 +301,7 @@ public:
     {
         HOOLIB_THROW("MalAtom couldn't be evaluated");
     }
-    std::string pr_str(bool print_readably) const;
+    void print(std::string& out, bool print_readably) const;
 
     void set_ref(MalTypePtr ref) { ref_ = std::move(ref); }
     MalTypePtr deref() { return ref_; }
@@ -142,7 +318,7 @@ private:
 public:
     MalSymbol(const std::string& name) : name_(name) {}
 
-    std::string pr_str(bool print_readably) const { return name_; }
+    void print(std::string& out, bool print_readably) const { out += name_; }
     const std::string& name() const { return name_; }
 
     MalTypePtr eval(EnvPtr env);
@@ -164,9 +340,9 @@ private:
 public:
     MalInteger(long long int data) : data_(data) {}
 
-    std::string pr_str(bool print_readably) const
+    void print(std::string& out, bool print_readably) const
     {
-        return HooLib::to_str(data_);
+        out += std::to_string(data_);
     }
     long long int get() const { return data_; }
 
@@ -183,7 +359,7 @@ class MalNil : public MalType {
     MAL_DEFINE_AS(MalNil, nil);
 
 public:
-    std::string pr_str(bool print_readably) const { return "nil"; }
+    void print(std::string& out, bool print_readably) const { out += "nil"; }
     MalTypePtr eval(EnvPtr env) { return get_this_pointer(); }
 };
 
@@ -192,7 +368,7 @@ class MalTrue : public MalType {
     MAL_DEFINE_AS(MalTrue, true);
 
 public:
-    std::string pr_str(bool print_readably) const { return "true"; }
+    void print(std::string& out, bool print_readably) const { out += "true"; }
     MalTypePtr eval(EnvPtr env) { return get_this_pointer(); }
 };
 
@@ -201,7 +377,7 @@ class MalFalse : public MalType {
     MAL_DEFINE_AS(MalFalse, false);
 
 public:
-    std::string pr_str(bool print_readably) const { return "false"; }
+    void print(std::string& out, bool print_readably) const { out += "false"; }
     MalTypePtr eval(EnvPtr env) { return get_this_pointer(); }
 };
 
@@ -210,24 +386,72 @@ class MalString : public MalType {
     MAL_DEFINE_AS(MalString, string);
 
 private:
-    std::string data_;
+    // A slice made by slice() refers to the chars of base_ instead of
+    // owning a copy in data_. get() copies them into data_ on the first
+    // call, since its callers want a std::string.
+    mutable std::string data_;
+    mutable std::shared_ptr<const MalString> base_;
+    std::string_view slice_;
 
 public:
-    MalString(const std::string& data) : data_(data) {}
+    MalString(std::string data) : data_(std::move(data)) {}
+    MalString(std::shared_ptr<const MalString> base, std::string_view slice)
+        : base_(std::move(base)), slice_(slice)
+    {
+    }
 
-    const std::string& get() const { return data_; }
+    const std::string& get() const
+    {
+        if (base_) {
+            data_ = slice_;
+            base_ = nullptr;
+        }
+        return data_;
+    }
+    std::string_view view() const { return base_ ? slice_ : data_; }
+
+    // [pos, pos + len) of this. Longer ones than std::string keeps inline
+    // share the chars of this.
+    std::shared_ptr<MalString> slice(size_t pos, size_t len) const;
 
-    std::string pr_str(bool print_readably) const;
+    void print(std::string& out, bool print_readably) const
+    {
+        print(out, view(), print_readably);
+    }
+    // of data as a string or a keyword
+    static void print(std::string& out, std::string_view data,
+                      bool print_readably);
 
     MalTypePtr eval(EnvPtr env) { return get_this_pointer(); }
 
     bool is_equal_to(const MalTypePtr& rhs) const
     {
         auto r = rhs->as_string();
-        return r && data_ == r->data_;
+        return r && view() == r->view();
     }
 };
 
+// what (string-builder) makes. sb-append! adds to the end in place, so
+// building a string of n pieces takes O(n) instead of the O(n^2) of
+// repeated str.
+class MalStringBuilder : public MalType {
+    MAL_DEFINE_GET_THIS_PTR(MalStringBuilder);
+    MAL_DEFINE_AS(MalStringBuilder, string_builder);
+
+private:
+    std::string data_;
+
+public:
+    void print(std::string& out, bool print_readably) const
+    {
+        out += "#<string-builder>";
+    }
+    MalTypePtr eval(EnvPtr env) { return get_this_pointer(); }
+
+    std::string& get() { return data_; }
+    const std::string& get() const { return data_; }
+};
+
 class MalSequential : public MalType {
     MAL_DEFINE_GET_THIS_PTR(MalSequential);
     MAL_DEFINE_AS(MalSequential, sequential);
@@ -242,12 +466,13 @@ public:
     MalSequential() {}
     MalSequential(std::vector<MalTypePtr> items) : items_(std::move(items)) {}
 
-    virtual std::string pr_str(bool print_readably) const
+    // the items separated by spaces
+    void print_items(std::string& out, bool print_readably) const
     {
-        return HooLib::join(HOOLIB_RANGE(items_), " ",
-                            [print_readably](auto item) {
-                                return item->pr_str(print_readably);
-                            });
+        for (size_t i = 0; i < items_.size(); i++) {
+            if (i != 0) out += ' ';
+            items_[i]->print(out, print_readably);
+        }
     }
 
     const std::vector<MalTypePtr>& get() const { return items_; }
@@ -256,22 +481,110 @@ public:
     bool is_equal_to(const MalTypePtr& rhs) const;
 };
 
+// The callee a call site saw last time and what kind of function it is, so
+// that mal_eval can skip the type checks while the callee stays the same.
+// ARITHMETIC is a MalArithmetic.
+// THROW is a builtin with is_throw(), whose value goes to handle() in mal_eval.
+// The callee isn't kept alive; a weak reference tells if it's gone.
+class MalCallSite {
+public:
+    enum class Kind : uint8_t { BUILTIN, CLOSURE, APPLY, ARITHMETIC, THROW };
+
+private:
+    const MalList& list_;
+    const MalType* callee_ = nullptr;
+    std::weak_ptr<MalType> alive_;
+    MalFunction* function_ = nullptr;
+    Kind kind_ = Kind::BUILTIN;
+    uint64_t hits_ = 0, misses_ = 0;
+
+public:
+    MalCallSite(const MalList& list);
+    ~MalCallSite();
+    MalCallSite(const MalCallSite&) = delete;
+    MalCallSite& operator=(const MalCallSite&) = delete;
+
+    // whether callee is the one seen last time
+    bool is(const MalType* callee) const
+    {
+        return callee == callee_ && !alive_.expired();
+    }
+
+    // makes callee the one seen last time. false if it's not a function.
+    bool update(const MalTypePtr& callee);
+
+    void count(bool hit) { hit ? hits_++ : misses_++; }
+
+    // of the callee seen last time. Whether it's a macro isn't kept, since
+    // defmacro! turns an existing function into one.
+    MalFunction* function() const { return function_; }
+    Kind kind() const { return kind_; }
+
+    const MalList& list() const { return list_; }
+    uint64_t hits() const { return hits_; }
+    uint64_t misses() const { return misses_; }
+};
+
 class MalList : public MalSequential {
     MAL_DEFINE_GET_THIS_PTR(MalList);
     MAL_DEFINE_AS(MalList, list);
 
+private:
+    mutable MalLambdaPtr lambda_;
+    mutable bool is_checked_loop_ = false;
+    mutable MalTypePtr expansion_;  // of threaded() or quasiquoted()
+    mutable std::shared_ptr<const MalFolding> folding_;
+    mutable std::shared_ptr<const MalInlining> inlining_;
+    mutable std::unique_ptr<MalCallSite> call_site_;
+
 public:
     MalList() {}
     MalList(std::vector<MalTypePtr> items) : MalSequential(std::move(items)) {}
 
-    std::string pr_str(bool print_readably) const
+    void print(std::string& out, bool print_readably) const
     {
-        std::stringstream ss;
-        ss << "(" << MalSequential::pr_str(print_readably) << ")";
-        return ss.str();
+        out += '(';
+        print_items(out, print_readably);
+        out += ')';
     }
 
     MalTypePtr eval(EnvPtr env);
+
+    // this list as a (fn* params body) form, parsed on the first call
+    const MalLambdaPtr& lambda() const;
+
+    // Makes sure that every recur in this (loop* bindings body) form is in
+    // tail position. Macros are expanded in env. Done on the first call.
+    void check_loop(const EnvPtr& env) const;
+
+    // this list as a (-> x form...) or (->> x form...) form rewritten into
+    // nested calls, done on the first call
+    const MalTypePtr& threaded() const;
+
+    // this list as a (quasiquote template) form translated into what
+    // builds the template, done on the first call
+    const MalTypePtr& quasiquoted() const;
+
+    // The value of this list as a call to pure builtins with constant
+    // arguments, or nullptr if it's not such a call. The value is computed
+    // on the first call and kept as long as the callees are still bound to
+    // the same functions in env.
+    MalTypePtr fold(const EnvPtr& env) const;
+
+    // The body of the callee with the arguments substituted, or nullptr if
+    // the callee is not a small global function calling only builtins. The
+    // globals the body refers to are replaced by their values. It's kept
+    // while no global is redefined (Env::generation()) and the callee is
+    // still bound in env.
+    MalTypePtr inlined(const EnvPtr& env) const;
+
+    // the inline cache of this list as a call, made on the first call
+    MalCallSite& call_site() const
+    {
+        if (!call_site_) call_site_ = std::make_unique<MalCallSite>(*this);
+        return *call_site_;
+    }
+    MalCallSite* call_site_if() const { return call_site_.get(); }
 };
 
 class MalVector : public MalSequential {
@@ -284,11 +597,11 @@ public:
     {
     }
 
-    std::string pr_str(bool print_readably) const
+    void print(std::string& out, bool print_readably) const
     {
-        std::stringstream ss;
-        ss << "[" << MalSequential::pr_str(print_readably) << "]";
-        return ss.str();
+        out += '[';
+        print_items(out, print_readably);
+        out += ']';
     }
 
     MalTypePtr eval(EnvPtr env);
@@ -309,7 +622,7 @@ public:
     MalHashMap(Container data) : data_(std::move(data)) {}
 
     MalTypePtr eval(EnvPtr env) override;
-    std::string pr_str(bool print_readably) const override;
+    void print(std::string& out, bool print_readably) const override;
 
     const Container& data() const { return data_; }
 
@@ -356,6 +669,320 @@ public:
     }
 };
 
+// A sequence whose items are computed when they're first needed, a chunk of
+// up to CHUNK_SIZE at a time. rest() shares the chunks computed so far, so
+// each item is computed once however the seq is walked. See mal::lazy for
+// the ways to make one.
+class MalLazySeq : public MalType {
+    MAL_DEFINE_GET_THIS_PTR(MalLazySeq);
+    MAL_DEFINE_AS(MalLazySeq, lazy_seq);
+
+public:
+    static constexpr size_t CHUNK_SIZE = 32;
+
+    // some items and the seq after them, nullptr at the end
+    struct Chunk {
+        std::vector<MalTypePtr> items;
+        std::shared_ptr<MalLazySeq> more;
+    };
+    // computes the first chunk
+    using Step = std::function<Chunk()>;
+
+private:
+    // shared by a seq and the ones rest() makes from it
+    struct Cell {
+        Step step;
+        Chunk chunk;
+        ~Cell();
+    };
+    std::shared_ptr<Cell> cell_;
+    size_t offset_;  // of the first item in the chunk
+
+public:
+    MalLazySeq(Step step);
+    MalLazySeq(std::shared_ptr<Cell> cell, size_t offset)
+        : cell_(std::move(cell)), offset_(offset)
+    {
+    }
+
+    // The first chunk, computed on the first call. Only the seq at the end
+    // has no items. Those before offset() belong to seqs this is the rest
+    // of.
+    const Chunk& chunk() const;
+    size_t offset() const { return offset_; }
+
+    bool empty() const { return offset_ == chunk().items.size(); }
+    MalTypePtr first() const;  // nil if empty
+    std::shared_ptr<MalLazySeq> rest() const;
+
+    // calls f with each item until it returns false
+    template <class F>
+    void each(F f) const
+    {
+        std::shared_ptr<const MalLazySeq> hold;
+        for (auto seq = this; seq; seq = hold.get()) {
+            const auto& chunk = seq->chunk();
+            for (size_t i = seq->offset_; i < chunk.items.size(); i++)
+                if (!f(chunk.items[i])) return;
+            hold = chunk.more;
+        }
+    }
+
+    MalTypePtr eval(EnvPtr env) { return get_this_pointer(); }
+    void print(std::string& out, bool print_readably) const;
+    bool is_equal_to(const MalTypePtr& rhs) const;
+    // whether this has the same items as items
+    bool equals(const std::vector<MalTypePtr>& items) const;
+};
+
+// What (map f), (filter pred), (remove pred) and (take n) return, and comp
+// of them. transduce, into and sequence push each item through all the
+// stages in turn, so no seq is made between two of them.
+class MalTransducer : public MalType {
+    MAL_DEFINE_GET_THIS_PTR(MalTransducer);
+    MAL_DEFINE_AS(MalTransducer, transducer);
+
+public:
+    struct Stage {
+        enum class Kind { MAP, FILTER, REMOVE, TAKE } kind;
+        std::shared_ptr<MalFunction> func;  // but for TAKE
+        long long int n;                    // for TAKE
+    };
+
+    // a run of items through the stages, which counts what take lets pass
+    class Pass {
+        std::shared_ptr<const MalTransducer> xform_;
+        std::vector<long long int> left_;
+        bool done_;
+
+    public:
+        Pass(std::shared_ptr<const MalTransducer> xform);
+
+        // item after the stages, or nullptr if one of them drops it
+        MalTypePtr step(MalTypePtr item);
+        // whether no more items will come out
+        bool done() const { return done_; }
+    };
+
+private:
+    std::vector<Stage> stages_;
+
+public:
+    MalTransducer(std::vector<Stage> stages) : stages_(std::move(stages)) {}
+
+    const std::vector<Stage>& stages() const { return stages_; }
+
+    // calls out with what comes out of the items of coll
+    void each(const MalTypePtr& coll,
+              const std::function<void(const MalTypePtr&)>& out) const;
+    // (sequence xform coll), which runs the stages a chunk at a time
+    std::shared_ptr<MalLazySeq> sequence(const MalTypePtr& coll) const;
+
+    MalTypePtr eval(EnvPtr env) { return get_this_pointer(); }
+    void print(std::string& out, bool print_readably) const
+    {
+        out += "#<transducer>";
+    }
+};
+
+namespace mal::detail {
+template <class T>
+struct Downcast;
+
+#define MAL_DEFINE_DOWNCAST(classname, typename)                   \
+    template <>                                                    \
+    struct Downcast<classname> {                                   \
+        static std::shared_ptr<classname> get(const MalTypePtr& v) \
+        {                                                          \
+            return v->as_##typename();                             \
+        }                                                          \
+    };
+
+MAL_DEFINE_DOWNCAST(MalInteger, integer);
+MAL_DEFINE_DOWNCAST(MalFunction, function);
+MAL_DEFINE_DOWNCAST(MalClosure, closure);
+MAL_DEFINE_DOWNCAST(MalAtom, atom);
+MAL_DEFINE_DOWNCAST(MalSymbol, symbol);
+MAL_DEFINE_DOWNCAST(MalString, string);
+MAL_DEFINE_DOWNCAST(MalStringBuilder, string_builder);
+MAL_DEFINE_DOWNCAST(MalSequential, sequential);
+MAL_DEFINE_DOWNCAST(MalList, list);
+MAL_DEFINE_DOWNCAST(MalVector, vector);
+MAL_DEFINE_DOWNCAST(MalHashMap, hash_map);
+MAL_DEFINE_DOWNCAST(MalLazySeq, lazy_seq);
+MAL_DEFINE_DOWNCAST(MalTransducer, transducer);
+
+// an argument declared as T& is checked to be a T. The object is kept alive
+// by the caller's argument, so a reference is enough.
+template <class T>
+struct ArgCast {
+    static T& get(const MalTypePtr& arg)
+    {
+        auto ptr = Downcast<T>::get(arg);
+        HOOLIB_THROW_UNLESS(ptr, "invalid argument");
+        return *ptr;
+    }
+};
+
+template <>
+struct ArgCast<MalType> {
+    static MalType& get(const MalTypePtr& arg) { return *arg; }
+};
+
+template <>
+struct ArgCast<MalTypePtr> {
+    static const MalTypePtr& get(const MalTypePtr& arg) { return arg; }
+};
+}  // namespace mal::detail
+
+// builtin of fixed arity. The arity and the argument types are taken from
+// the parameters of F, so calls reach F without std::function or an
+// argument list. See mal::builtin.
+template <class F, class... Params>
+class MalBuiltin : public MalFunction {
+private:
+    F func_;
+
+    template <class Param>
+    static decltype(auto) cast(const MalTypePtr& arg)
+    {
+        return mal::detail::ArgCast<Param>::get(arg);
+    }
+
+    template <size_t... I>
+    MalTypePtr invoke(const Args& args, std::index_sequence<I...>)
+    {
+        return func_(cast<Params>(args.begin()[I])...);
+    }
+
+public:
+    MalBuiltin(F func) : func_(std::move(func)) {}
+
+    MalTypePtr callN(const Args& args) override
+    {
+        HOOLIB_THROW_UNLESS(args.size() == sizeof...(Params),
+                            "invalid number of arguments");
+        return invoke(args, std::index_sequence_for<Params...>());
+    }
+
+    MalTypePtr call1(const MalTypePtr& arg) override
+    {
+        if constexpr (sizeof...(Params) == 1)
+            return func_(cast<Params>(arg)...);
+        else
+            return MalFunction::call1(arg);
+    }
+
+    MalTypePtr call2(const MalTypePtr& lhs, const MalTypePtr& rhs) override
+    {
+        if constexpr (sizeof...(Params) == 2)
+            return invoke2<Params...>(lhs, rhs);
+        else
+            return MalFunction::call2(lhs, rhs);
+    }
+
+private:
+    template <class Lhs, class Rhs>
+    MalTypePtr invoke2(const MalTypePtr& lhs, const MalTypePtr& rhs)
+    {
+        return func_(cast<Lhs>(lhs), cast<Rhs>(rhs));
+    }
+};
+
+// +, -, *, / and the comparisons on integers. They take any number of
+// arguments. mal_eval and the VM recognize calls to them and go to apply()
+// directly instead of through callN().
+class MalArithmetic : public MalFunction {
+public:
+    enum class Op : uint8_t { ADD, SUB, MUL, DIV, LT, LE, GT, GE };
+
+private:
+    Op op_;
+
+public:
+    MalArithmetic(Op op) : op_(op) {}
+
+    Op op() const { return op_; }
+
+    // raises a mal exception on overflow and division by zero
+    MalTypePtr apply(const Args& args) const;
+
+    MalTypePtr callN(const Args& args) override { return apply(args); }
+};
+
 MalTypePtr mal_eval(MalTypePtr ast, EnvPtr env);
+MalTypePtr quasiquote(const MalTypePtr& ast);
+MalTypePtr macroexpand(MalTypePtr ast, const EnvPtr& env);
+
+namespace mal {
+// Evaluation raises a mal exception instead of using more than this many
+// bytes for its own call stack.
+void set_stack_limit(size_t bytes);
+size_t stack_limit();
+
+// whether mal_eval and the bytecode compiler use MalList::fold(). On by
+// default.
+void set_constant_folding(bool is_on);
+bool constant_folding();
+
+// whether mal_eval and the bytecode compiler use MalList::inlined(). On by
+// default.
+void set_inlining(bool is_on);
+bool inlining();
+
+// Kept by mal_eval and the VM while they run. They enter each other on the
+// C++ stack, e.g. when a closure compiled by tiering calls one that isn't.
+// Entering raises a mal exception "stack overflow" instead of using up the
+// C++ stack.
+class EngineEntry {
+public:
+    EngineEntry();
+    ~EngineEntry();
+    EngineEntry(const EngineEntry&) = delete;
+    EngineEntry& operator=(const EngineEntry&) = delete;
+
+    // the number of engines running on the C++ stack
+    static size_t depth();
+};
+
+// every call site mal_eval has gone through and is still alive, to see how
+// often their inline caches hit
+std::vector<const MalCallSite*> call_sites();
+
+// Tiered execution: mal_eval passes a closure to hook on its threshold-th
+// call. 0 turns it off, which is the default. The VM provides a hook; see
+// mal::vm::set_tiering().
+using TierUpHook = void (*)(const std::shared_ptr<MalClosure>& closure);
+void set_tier_up(uint32_t threshold, TierUpHook hook);
+uint32_t tier_up_threshold();
+}  // namespace mal
+
+// Lazy seqs. Each takes a list, a vector, a lazy seq or nil as coll, and
+// computes the items a chunk at a time as the result is walked.
+namespace mal::lazy {
+// coll as a lazy seq
+std::shared_ptr<MalLazySeq> seq(const MalTypePtr& coll);
+// (lazy-seq body) calls thunk once, when the items are first needed, and is
+// the seq thunk returns
+std::shared_ptr<MalLazySeq> from_thunk(std::shared_ptr<MalFunction> thunk);
+// (cons head coll) on a lazy coll
+std::shared_ptr<MalLazySeq> cons(MalTypePtr head,
+                                 std::shared_ptr<MalLazySeq> coll);
+// start, start + step, ... while before end. No end makes it infinite.
+std::shared_ptr<MalLazySeq> range(long long int start,
+                                  std::optional<long long int> end,
+                                  long long int step);
+std::shared_ptr<MalLazySeq> map(std::shared_ptr<MalFunction> func,
+                                const MalTypePtr& coll);
+std::shared_ptr<MalLazySeq> filter(std::shared_ptr<MalFunction> pred,
+                                   const MalTypePtr& coll);
+std::shared_ptr<MalLazySeq> remove(std::shared_ptr<MalFunction> pred,
+                                   const MalTypePtr& coll);
+std::shared_ptr<MalLazySeq> take(long long int n, const MalTypePtr& coll);
+std::shared_ptr<MalLazySeq> drop(long long int n, const MalTypePtr& coll);
+// x, (func x), (func (func x)), ...
+std::shared_ptr<MalLazySeq> iterate(std::shared_ptr<MalFunction> func,
+                                    MalTypePtr x);
+}  // namespace mal::lazy
 
 #endif
@@ -0,0 +1,1295 @@
+#include "vm.hpp"
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <utility>
+#include "exception.hpp"
+#include "factory.hpp"
+#include "helper.hpp"
+#include "jit.hpp"
+
+#if defined(__GNUC__)
+#define MAL_VM_COMPUTED_GOTO
+#endif
+
+namespace mal::vm {
+namespace {
+
+// X(name): one instruction. Operands follow the opcode in the code vector.
+#define MAL_VM_OPCODES(X)                                           \
+    X(CONST)         /* idx             : push consts[idx] */       \
+    X(LOAD_LOCAL)    /* depth slot name : push a local */           \
+    X(STORE_LOCAL)   /* slot            : pop into a local */       \
+    X(UNSHARE)       /*                 : copy frame if captured */ \
+    X(LOAD_GLOBAL)   /* name            : push env[name], cached */ \
+    X(STORE_GLOBAL)  /* name            : env[name] = top */        \
+    X(DEF_MACRO)     /* name            : env[name] = macro(top) */ \
+    X(POP)           /*                 : drop top */               \
+    X(JUMP)          /* target */                                   \
+    X(JUMP_IF_FALSE) /* target          : pop, jump if falsy */     \
+    X(AND)           /* target          : jump if top is falsy */   \
+    X(OR)            /* target          : jump if top is truthy */  \
+    X(THROW)         /*                 : throw top */              \
+    X(FOLD)          /* idx target      : folded consts[idx] */     \
+    X(INLINED)       /* idx idx site target : jump if redefined */  \
+    X(ARITH)         /* idx argc name site */                       \
+    X(CALL)          /* argc */                                     \
+    X(TAIL_CALL)     /* argc */                                     \
+    X(RETURN)                                                       \
+    X(MAKE_CLOSURE)  /* proto */                                    \
+    X(MAKE_VECTOR)   /* n */                                        \
+    X(MAKE_HASH_MAP) /* n               : n key-value pairs */      \
+    X(TRY_BEGIN)     /* target slot     : push a handler */         \
+    X(TRY_END)       /*                 : pop a handler */
+
+enum class Op : uint32_t {
+#define MAL_VM_ENUM(name) name,
+    MAL_VM_OPCODES(MAL_VM_ENUM)
+#undef MAL_VM_ENUM
+};
+
+// local variables of one function activation
+struct Frame {
+    std::vector<MalTypePtr> slots;
+    std::shared_ptr<Frame> parent;
+
+    Frame(size_t nslots, std::shared_ptr<Frame> parent)
+        : slots(nslots), parent(std::move(parent))
+    {
+    }
+};
+
+// compile-time scopes. Bindings are persistent lists so that a closure can
+// keep a snapshot of what is visible at its fn* and be compiled later.
+struct Binding;
+using BindingPtr = std::shared_ptr<const Binding>;
+struct Binding {
+    std::string name;
+    uint32_t slot;
+    BindingPtr next;
+};
+
+struct Scope;
+using ScopePtr = std::shared_ptr<const Scope>;
+struct Scope {
+    BindingPtr head;
+    ScopePtr parent;
+};
+
+struct Proto;
+using ProtoPtr = std::shared_ptr<Proto>;
+
+// what LOAD_GLOBAL found last time, kept until a global is redefined
+struct GlobalCache {
+    MalTypePtr value;
+    uint64_t generation;
+};
+
+struct Code {
+    std::vector<uint32_t> words;
+    std::vector<MalTypePtr> consts;
+    std::vector<std::string> names;
+    std::vector<ProtoPtr> protos;
+    mutable std::vector<GlobalCache> globals;  // by the index into names
+    // by site, the generation at which a callee was last seen unchanged
+    mutable std::vector<uint64_t> generations;
+    uint32_t nslots = 0;
+};
+using CodePtr = std::shared_ptr<const Code>;
+
+struct Proto {
+    std::vector<std::string> params;
+    bool variadic;
+    MalTypePtr body;
+    ScopePtr outer;
+    CodePtr code;  // compiled on the first call
+
+    const CodePtr& compiled(const EnvPtr& env);
+};
+
+class Closure : public MalFunction {
+private:
+    ProtoPtr proto_;
+    std::shared_ptr<Frame> frame_;
+    EnvPtr env_;
+
+public:
+    Closure(ProtoPtr proto, std::shared_ptr<Frame> frame, EnvPtr env)
+        : proto_(std::move(proto)),
+          frame_(std::move(frame)),
+          env_(std::move(env))
+    {
+    }
+
+    const ProtoPtr& proto() const { return proto_; }
+    const EnvPtr& env() const { return env_; }
+
+    // reusable is overwritten instead of allocating a new frame if it's an
+    // unshared frame of this closure.
+    template <class Iterator>
+    std::shared_ptr<Frame> bind(Iterator begin, Iterator end, const Code& code,
+                                std::shared_ptr<Frame>* reusable = nullptr) const
+    {
+        const auto& params = proto_->params;
+        size_t nfixed = proto_->variadic ? params.size() - 1 : params.size();
+        size_t nargs = std::distance(begin, end);
+        HOOLIB_THROW_UNLESS(
+            (proto_->variadic && nargs >= nfixed) ||
+                (!proto_->variadic && nargs == nfixed),
+            "invalid argument");
+        std::shared_ptr<Frame> frame;
+        if (reusable && reusable->use_count() == 1 &&
+            (*reusable)->parent == frame_ &&
+            (*reusable)->slots.size() == code.nslots) {
+            frame = std::move(*reusable);
+            std::fill(frame->slots.begin() + nfixed, frame->slots.end(), nullptr);
+        }
+        else {
+            frame = std::make_shared<Frame>(code.nslots, frame_);
+        }
+        std::copy(begin, begin + nfixed, frame->slots.begin());
+        if (proto_->variadic)
+            frame->slots[nfixed] =
+                mal::list(std::vector<MalTypePtr>(begin + nfixed, end));
+        return frame;
+    }
+
+    MalTypePtr callN(const Args& args) override;
+};
+
+class Compiler {
+private:
+    Code& code_;
+    const EnvPtr& env_;
+    ScopePtr outer_;
+    // locals_ is what the current expression sees; visible_ additionally
+    // holds let* bindings whose value is being compiled, so that closures
+    // in the value can refer to the binding itself as with Env in mal_eval.
+    BindingPtr locals_, visible_;
+
+    // the innermost loop* whose body is being compiled in tail position
+    struct Loop {
+        uint32_t start;
+        std::vector<uint32_t> slots;
+    };
+    const Loop* loop_ = nullptr;
+
+    // Set when compiling for tiering on the compiler thread. env_ is then a
+    // copy of the globals taken at this generation, and MalList::fold() and
+    // inlined(), which update the caches of the AST, are not used. Nor is
+    // Env::generation(), which the evaluating thread writes.
+    std::optional<uint64_t> snapshot_generation_;
+
+public:
+    Compiler(Code& code, const EnvPtr& env, ScopePtr outer,
+             std::optional<uint64_t> snapshot_generation = std::nullopt)
+        : code_(code),
+          env_(env),
+          outer_(std::move(outer)),
+          snapshot_generation_(snapshot_generation)
+    {
+    }
+
+    void compile_function(const Proto& proto)
+    {
+        for (auto&& name : proto.params) locals_ = bind(name);
+        visible_ = locals_;
+        compile(proto.body, true);
+        emit(Op::RETURN);
+        code_.globals.resize(code_.names.size());
+    }
+
+    void compile_script(const MalTypePtr& ast)
+    {
+        compile(ast, true);
+        emit(Op::RETURN);
+        code_.globals.resize(code_.names.size());
+    }
+
+private:
+    BindingPtr bind(const std::string& name)
+    {
+        return std::make_shared<Binding>(
+            Binding{name, code_.nslots++, locals_});
+    }
+
+    static std::optional<uint32_t> find(BindingPtr head,
+                                        const std::string& name)
+    {
+        for (; head; head = head->next)
+            if (head->name == name) return head->slot;
+        return std::nullopt;
+    }
+
+    std::optional<std::tuple<uint32_t, uint32_t>> resolve(
+        const std::string& name) const
+    {
+        if (auto slot = find(locals_, name)) return std::make_tuple(0u, *slot);
+        uint32_t depth = 1;
+        for (auto scope = outer_; scope; scope = scope->parent, depth++)
+            if (auto slot = find(scope->head, name))
+                return std::make_tuple(depth, *slot);
+        return std::nullopt;
+    }
+
+    template <class... Operands>
+    size_t emit(Op op, Operands... operands)
+    {
+        code_.words.push_back(static_cast<uint32_t>(op));
+        (code_.words.push_back(static_cast<uint32_t>(operands)), ...);
+        return code_.words.size();
+    }
+
+    uint32_t here() const { return code_.words.size(); }
+    void patch(size_t next, uint32_t target) { code_.words[next - 1] = target; }
+
+    uint32_t add_const(const MalTypePtr& value)
+    {
+        code_.consts.push_back(value);
+        return code_.consts.size() - 1;
+    }
+
+    uint32_t add_name(const std::string& name)
+    {
+        code_.names.push_back(name);
+        return code_.names.size() - 1;
+    }
+
+    uint32_t add_site(uint64_t generation)
+    {
+        code_.generations.push_back(generation);
+        return code_.generations.size() - 1;
+    }
+
+    MalTypePtr expand(MalTypePtr ast) const
+    {
+        while (true) {
+            auto list = ast->as_list();
+            if (!list || list->get().empty()) return ast;
+            const auto& items = list->get();
+            auto symbol = items[0]->as_symbol();
+            if (!symbol || resolve(symbol->name())) return ast;
+            auto value = env_->get_if(symbol->name());
+            auto func = value ? value->as_function() : nullptr;
+            if (!func || !func->is_macro()) return ast;
+            ast = func->callN(MalFunction::Args(items.data() + 1,
+                                                items.data() + items.size()));
+        }
+    }
+
+    void compile(MalTypePtr ast, bool tail)
+    {
+        HOOLIB_THROW_UNLESS(ast, "invalid ast");
+        ast = expand(ast);
+
+        if (auto symbol = ast->as_symbol()) {
+            if (auto local = resolve(symbol->name())) {
+                auto [ depth, slot ] = *local;
+                emit(Op::LOAD_LOCAL, depth, slot, add_name(symbol->name()));
+            }
+            else {
+                emit(Op::LOAD_GLOBAL, add_name(symbol->name()));
+            }
+            return;
+        }
+
+        if (auto vector = ast->as_vector()) {
+            for (auto&& item : vector->get()) compile_operand(item);
+            emit(Op::MAKE_VECTOR, vector->get().size());
+            return;
+        }
+
+        if (auto hash = ast->as_hash_map()) {
+            for (auto && [ key, value ] : hash->data()) {
+                emit(Op::CONST, add_const(mal::string(key)));
+                compile_operand(value);
+            }
+            emit(Op::MAKE_HASH_MAP, hash->data().size());
+            return;
+        }
+
+        auto list = ast->as_list();
+        if (!list || list->get().empty()) {
+            emit(Op::CONST, add_const(ast));
+            return;
+        }
+
+        const auto& args = list->get();
+        if (auto symbol = args[0]->as_symbol())
+            if (compile_special(symbol->name(), *list, tail)) return;
+
+        // The call is still compiled, for when a callee gets redefined.
+        std::optional<size_t> to_end;
+        if (mal::constant_folding() && !snapshot_generation_ &&
+            !refers_to_local(ast) && list->fold(env_))
+            to_end = emit(Op::FOLD, add_const(ast), 0);
+
+        std::optional<size_t> to_end_of_inlined;
+        auto head = args[0]->as_symbol();
+        if (mal::inlining() && !snapshot_generation_ && head &&
+            !resolve(head->name())) {
+            if (auto body = list->inlined(env_)) {
+                // Globals are looked up only in env_, so the inlined body
+                // stays valid as long as inlining the call again gives it.
+                auto to_call =
+                    emit(Op::INLINED, add_const(ast), add_const(body),
+                         add_site(Env::generation()), 0);
+                compile(body, tail);
+                to_end_of_inlined = emit(Op::JUMP, 0);
+                patch(to_call, here());
+            }
+        }
+
+        // The operator goes on the stack only when it has been redefined.
+        auto value = head && !resolve(head->name())
+                         ? env_->get_if(head->name())
+                         : nullptr;
+        if (value && dynamic_cast<MalArithmetic*>(value.get())) {
+            for (size_t i = 1; i < args.size(); i++) compile_operand(args[i]);
+            auto generation = snapshot_generation_ ? *snapshot_generation_
+                                                   : Env::generation();
+            emit(Op::ARITH, add_const(value), args.size() - 1,
+                 add_name(head->name()), add_site(generation));
+        }
+        else {
+            for (auto&& item : args) compile_operand(item);
+        }
+        emit(tail ? Op::TAIL_CALL : Op::CALL, args.size() - 1);
+        if (to_end) patch(*to_end, here());
+        if (to_end_of_inlined) patch(*to_end_of_inlined, here());
+    }
+
+    bool refers_to_local(const MalTypePtr& ast) const
+    {
+        if (auto symbol = ast->as_symbol()) return bool(resolve(symbol->name()));
+        if (auto seq = ast->as_sequential())
+            for (auto&& item : seq->get())
+                if (refers_to_local(item)) return true;
+        return false;
+    }
+
+    // compiles ast in non-tail position, where recur isn't allowed
+    void compile_operand(const MalTypePtr& ast)
+    {
+        auto saved_loop = std::exchange(loop_, nullptr);
+        compile(ast, false);
+        loop_ = saved_loop;
+    }
+
+    // compiles args[begin..] like the body of do
+    void compile_body(const std::vector<MalTypePtr>& args, size_t begin,
+                      bool tail)
+    {
+        if (begin == args.size()) {
+            emit(Op::CONST, add_const(mal::nil()));
+            return;
+        }
+        for (size_t i = begin; i < args.size() - 1; i++) {
+            compile_operand(args[i]);
+            emit(Op::POP);
+        }
+        compile(args.back(), tail);
+    }
+
+    bool compile_special(const std::string& name, const MalList& list,
+                         bool tail)
+    {
+        const auto& args = list.get();
+
+        if (name == "def!" || name == "defmacro!") {
+            HOOLIB_THROW_UNLESS(args.size() == 3, "invalid number of argument");
+            auto key_symbol = args[1]->as_symbol();
+            HOOLIB_THROW_UNLESS(key_symbol, "invalid argument");
+            // Inside fn*, let* and the like, mal_eval defines the name in the
+            // innermost environment, so it's a local until the end of the
+            // scope here. It's visible to closures in the value as with let*.
+            if (name == "def!" && (locals_ || outer_)) {
+                auto binding = bind(key_symbol->name());
+                visible_ = std::make_shared<Binding>(
+                    Binding{binding->name, binding->slot, visible_});
+                compile_operand(args[2]);
+                emit(Op::STORE_LOCAL, binding->slot);
+                locals_ = binding;
+                emit(Op::LOAD_LOCAL, 0, binding->slot,
+                     add_name(binding->name));
+                return true;
+            }
+            compile_operand(args[2]);
+            emit(name == "def!" ? Op::STORE_GLOBAL : Op::DEF_MACRO,
+                 add_name(key_symbol->name()));
+            return true;
+        }
+
+        if (name == "let*") {
+            HOOLIB_THROW_UNLESS(args.size() == 3, "invalid number of argument");
+            auto bindings_src = args[1]->as_sequential();
+            HOOLIB_THROW_UNLESS(bindings_src, "invalid argument");
+            const auto& bindings = bindings_src->get();
+            HOOLIB_THROW_UNLESS(bindings.size() % 2 == 0, "invalid argument");
+
+            auto saved_locals = locals_, saved_visible = visible_;
+            for (auto it = bindings.begin(); it != bindings.end();) {
+                auto key_symbol = (*it++)->as_symbol();
+                HOOLIB_THROW_UNLESS(key_symbol, "invalid argument");
+                auto binding = bind(key_symbol->name());
+                visible_ = std::make_shared<Binding>(
+                    Binding{binding->name, binding->slot, visible_});
+                compile_operand(*it++);
+                emit(Op::STORE_LOCAL, binding->slot);
+                locals_ = binding;
+            }
+            compile(args[2], tail);
+            locals_ = saved_locals;
+            visible_ = saved_visible;
+            return true;
+        }
+
+        if (name == "loop*") {
+            HOOLIB_THROW_UNLESS(args.size() == 3, "invalid number of argument");
+            auto bindings_src = args[1]->as_sequential();
+            HOOLIB_THROW_UNLESS(bindings_src, "invalid argument");
+            const auto& bindings = bindings_src->get();
+            HOOLIB_THROW_UNLESS(bindings.size() % 2 == 0, "invalid argument");
+
+            auto saved_locals = locals_, saved_visible = visible_;
+            Loop loop;
+            for (auto it = bindings.begin(); it != bindings.end();) {
+                auto key_symbol = (*it++)->as_symbol();
+                HOOLIB_THROW_UNLESS(key_symbol, "invalid argument");
+                auto binding = bind(key_symbol->name());
+                visible_ = std::make_shared<Binding>(
+                    Binding{binding->name, binding->slot, visible_});
+                compile_operand(*it++);
+                emit(Op::STORE_LOCAL, binding->slot);
+                locals_ = binding;
+                loop.slots.push_back(binding->slot);
+            }
+            loop.start = here();
+            auto saved_loop = std::exchange(loop_, &loop);
+            compile(args[2], tail);
+            loop_ = saved_loop;
+            locals_ = saved_locals;
+            visible_ = saved_visible;
+            return true;
+        }
+
+        // recur stores the new values into the loop's slots and jumps back.
+        // Closures made in the previous iterations keep a copy of the frame.
+        if (name == "recur") {
+            HOOLIB_THROW_UNLESS(loop_, "recur not in tail position");
+            auto loop = loop_;
+            HOOLIB_THROW_UNLESS(args.size() - 1 == loop->slots.size(),
+                                "invalid number of arguments");
+            for (size_t i = 1; i < args.size(); i++) compile_operand(args[i]);
+            emit(Op::UNSHARE);
+            for (auto it = loop->slots.rbegin(); it != loop->slots.rend(); ++it)
+                emit(Op::STORE_LOCAL, *it);
+            emit(Op::JUMP, loop->start);
+            return true;
+        }
+
+        if (name == "do") {
+            compile_body(args, 1, tail);
+            return true;
+        }
+
+        if (name == "cond") {
+            std::vector<size_t> to_end;
+            for (size_t i = 1; i < args.size(); i += 2) {
+                if (i + 1 == args.size()) {
+                    emit(Op::CONST, add_const(mal::string(
+                                        "odd number of forms to cond")));
+                    emit(Op::THROW);
+                    break;
+                }
+                compile_operand(args[i]);
+                auto to_next = emit(Op::JUMP_IF_FALSE, 0);
+                compile(args[i + 1], tail);
+                to_end.push_back(emit(Op::JUMP, 0));
+                patch(to_next, here());
+            }
+            emit(Op::CONST, add_const(mal::nil()));
+            for (auto&& next : to_end) patch(next, here());
+            return true;
+        }
+
+        if (name == "and" || name == "or") {
+            if (args.size() == 1) {
+                emit(Op::CONST,
+                     add_const(name == "and" ? MalTypePtr(mal::true_())
+                                             : MalTypePtr(mal::nil())));
+                return true;
+            }
+            std::vector<size_t> to_end;
+            for (size_t i = 1; i < args.size() - 1; i++) {
+                compile_operand(args[i]);
+                to_end.push_back(emit(name == "and" ? Op::AND : Op::OR, 0));
+            }
+            compile(args.back(), tail);
+            for (auto&& next : to_end) patch(next, here());
+            return true;
+        }
+
+        if (name == "when" || name == "when-not") {
+            HOOLIB_THROW_UNLESS(args.size() >= 2,
+                                "invalid number of arguments");
+            compile_operand(args[1]);
+            auto to_second = emit(Op::JUMP_IF_FALSE, 0);
+            // the branch taken when the test is true, then the other one
+            if (name == "when")
+                compile_body(args, 2, tail);
+            else
+                emit(Op::CONST, add_const(mal::nil()));
+            auto to_end = emit(Op::JUMP, 0);
+            patch(to_second, here());
+            if (name == "when")
+                emit(Op::CONST, add_const(mal::nil()));
+            else
+                compile_body(args, 2, tail);
+            patch(to_end, here());
+            return true;
+        }
+
+        if (name == "->" || name == "->>") {
+            compile(list.threaded(), tail);
+            return true;
+        }
+
+        if (name == "if") {
+            HOOLIB_THROW_UNLESS(args.size() == 3 || args.size() == 4,
+                                "invalid argument");
+            compile_operand(args[1]);
+            auto to_else = emit(Op::JUMP_IF_FALSE, 0);
+            compile(args[2], tail);
+            auto to_end = emit(Op::JUMP, 0);
+            patch(to_else, here());
+            if (args.size() == 3)
+                emit(Op::CONST, add_const(mal::nil()));
+            else
+                compile(args[3], tail);
+            patch(to_end, here());
+            return true;
+        }
+
+        if (name == "fn*") {
+            HOOLIB_THROW_UNLESS(args.size() == 3,
+                                "invalid number of arguments");
+            auto seq = args[1]->as_sequential();
+            HOOLIB_THROW_UNLESS(seq, "invalid argument");
+            const auto& binds_src = seq->get();
+            auto proto = std::make_shared<Proto>();
+            proto->variadic = false;
+            for (auto&& item : binds_src) {
+                auto symbol = item->as_symbol();
+                HOOLIB_THROW_UNLESS(symbol, "invalid argument");
+                if (symbol->name() == "&") {
+                    proto->variadic = true;
+                    break;
+                }
+                proto->params.push_back(symbol->name());
+            }
+            if (proto->variadic) {
+                HOOLIB_THROW_UNLESS(
+                    proto->params.size() + 2 == binds_src.size(),
+                    "invalid argument");
+                auto symbol = binds_src.back()->as_symbol();
+                HOOLIB_THROW_UNLESS(symbol, "invalid argument");
+                proto->params.push_back(symbol->name());
+            }
+            proto->body = args[2];
+            proto->outer = std::make_shared<Scope>(Scope{visible_, outer_});
+            code_.protos.push_back(proto);
+            emit(Op::MAKE_CLOSURE, code_.protos.size() - 1);
+            return true;
+        }
+
+        if (name == "quote") {
+            HOOLIB_THROW_UNLESS(args.size() == 2,
+                                "invalid number of arguments");
+            emit(Op::CONST, add_const(args[1]));
+            return true;
+        }
+
+        if (name == "quasiquote") {
+            compile(list.quasiquoted(), tail);
+            return true;
+        }
+
+        if (name == "macroexpand") {
+            HOOLIB_THROW_UNLESS(args.size() == 2,
+                                "invalid number of arguments");
+            emit(Op::CONST, add_const(expand(args[1])));
+            return true;
+        }
+
+        if (name == "try*") {
+            HOOLIB_THROW_UNLESS(args.size() == 3,
+                                "invalid number of arguments");
+            auto catch_list = args[2]->as_list();
+            HOOLIB_THROW_UNLESS(catch_list && catch_list->get().size() == 3,
+                                "invalid argument");
+            auto catch_symbol = catch_list->get()[0]->as_symbol();
+            HOOLIB_THROW_UNLESS(catch_symbol->name() == "catch*",
+                                "invalid argument");
+            auto excep_bind_symbol = catch_list->get()[1]->as_symbol();
+            HOOLIB_THROW_UNLESS(excep_bind_symbol, "invalid argument");
+
+            auto binding = bind(excep_bind_symbol->name());
+            auto to_handler = emit(Op::TRY_BEGIN, 0, binding->slot) - 1;
+            compile_operand(args[1]);
+            emit(Op::TRY_END);
+            auto to_end = emit(Op::JUMP, 0);
+            patch(to_handler, here());
+
+            auto saved_locals = locals_, saved_visible = visible_;
+            locals_ = binding;
+            visible_ = std::make_shared<Binding>(
+                Binding{binding->name, binding->slot, visible_});
+            compile(catch_list->get()[2], tail);
+            locals_ = saved_locals;
+            visible_ = saved_visible;
+            patch(to_end, here());
+            return true;
+        }
+
+        return false;
+    }
+};
+
+const CodePtr& Proto::compiled(const EnvPtr& env)
+{
+    if (!code) {
+        auto new_code = std::make_shared<Code>();
+        Compiler(*new_code, env, outer).compile_function(*this);
+        code = std::move(new_code);
+    }
+    return code;
+}
+
+struct CallFrame {
+    CodePtr code;
+    uint32_t pc;
+    std::shared_ptr<Frame> frame;
+    EnvPtr env;
+    size_t base;  // stack size to restore on return
+};
+
+struct Handler {
+    size_t depth;  // index of the call frame that installed the handler
+    size_t sp;
+    uint32_t target, slot;
+};
+
+// One Machine runs per entry from native code, so that a builtin holding
+// arguments on the stack of its caller is never invalidated by a reentrant
+// call into the VM.
+class Machine {
+private:
+    std::vector<MalTypePtr> stack_;
+    std::vector<CallFrame> calls_;
+    std::vector<Handler> handlers_;
+
+public:
+    // drop what an exception left behind
+    void clear()
+    {
+        stack_.clear();
+        calls_.clear();
+        handlers_.clear();
+    }
+
+    MalTypePtr run(CodePtr code, std::shared_ptr<Frame> frame, EnvPtr env)
+    {
+        calls_.push_back(
+            CallFrame{std::move(code), 0, std::move(frame), std::move(env), 0});
+        while (true) {
+            try {
+                return dispatch();
+            }
+            catch (mal::Exception& ex) {
+                if (!handle(ex.get())) throw;
+            }
+        }
+    }
+
+private:
+    // Moves to the innermost handler with thrown bound. false if there is
+    // none in this machine.
+    bool handle(const MalTypePtr& thrown)
+    {
+        if (handlers_.empty()) return false;
+        auto handler = handlers_.back();
+        handlers_.pop_back();
+        calls_.erase(calls_.begin() + handler.depth + 1, calls_.end());
+        auto& cf = calls_.back();
+        cf.frame->slots[handler.slot] = thrown;
+        cf.pc = handler.target;
+        stack_.resize(handler.sp);
+        return true;
+    }
+
+    MalTypePtr pop()
+    {
+        auto value = std::move(stack_.back());
+        stack_.pop_back();
+        return value;
+    }
+
+    MalTypePtr dispatch();
+};
+
+MalTypePtr Machine::dispatch()
+{
+    CallFrame* cf = &calls_.back();
+    const uint32_t* code = cf->code->words.data();
+    uint32_t pc = cf->pc;
+
+#define MAL_VM_RELOAD()                   \
+    {                                     \
+        cf = &calls_.back();              \
+        code = cf->code->words.data();    \
+        pc = cf->pc;                      \
+    }
+
+#ifdef MAL_VM_COMPUTED_GOTO
+    static const void* const labels[] = {
+#define MAL_VM_LABEL(name) &&op_##name,
+        MAL_VM_OPCODES(MAL_VM_LABEL)
+#undef MAL_VM_LABEL
+    };
+#define MAL_VM_CASE(name) op_##name:
+#define MAL_VM_DISPATCH() goto* labels[code[pc++]]
+    MAL_VM_DISPATCH();
+#else
+#define MAL_VM_CASE(name) case Op::name:
+#define MAL_VM_DISPATCH() continue
+    while (true) switch (static_cast<Op>(code[pc++])) {
+#endif
+
+    MAL_VM_CASE(CONST)
+    {
+        stack_.push_back(cf->code->consts[code[pc++]]);
+        MAL_VM_DISPATCH();
+    }
+
+    MAL_VM_CASE(LOAD_LOCAL)
+    {
+        uint32_t depth = code[pc++], slot = code[pc++], name = code[pc++];
+        Frame* frame = cf->frame.get();
+        while (depth-- > 0) frame = frame->parent.get();
+        const auto& value = frame->slots[slot];
+        if (!value) MAL_THROW_STRING("'", cf->code->names[name], "' not found");
+        stack_.push_back(value);
+        MAL_VM_DISPATCH();
+    }
+
+    MAL_VM_CASE(STORE_LOCAL)
+    {
+        cf->frame->slots[code[pc++]] = pop();
+        MAL_VM_DISPATCH();
+    }
+
+    MAL_VM_CASE(UNSHARE)
+    {
+        if (cf->frame.use_count() != 1)
+            cf->frame = std::make_shared<Frame>(*cf->frame);
+        MAL_VM_DISPATCH();
+    }
+
+    // The environment of the code is the root one or a sealed one of a
+    // closure (MalClosure::is_sealed()), where a global looked up once stays
+    // until it's redefined.
+    MAL_VM_CASE(LOAD_GLOBAL)
+    {
+        auto& cache = cf->code->globals[code[pc]];
+        if (!cache.value || cache.generation != Env::generation()) {
+            cache.value = cf->env->get(cf->code->names[code[pc]]);
+            cache.generation = Env::generation();
+        }
+        stack_.push_back(cache.value);
+        pc++;
+        MAL_VM_DISPATCH();
+    }
+
+    MAL_VM_CASE(STORE_GLOBAL)
+    {
+        cf->env->set(cf->code->names[code[pc++]], stack_.back());
+        MAL_VM_DISPATCH();
+    }
+
+    MAL_VM_CASE(DEF_MACRO)
+    {
+        // Only closures, as in mal_eval, so that ARITH never runs a macro.
+        auto func = stack_.back()->as_function();
+        HOOLIB_THROW_UNLESS(func && (dynamic_cast<Closure*>(func.get()) ||
+                                     func->as_closure()),
+                            "invalid argument");
+        func->set_macro();
+        cf->env->set(cf->code->names[code[pc++]], func);
+        MAL_VM_DISPATCH();
+    }
+
+    MAL_VM_CASE(POP)
+    {
+        stack_.pop_back();
+        MAL_VM_DISPATCH();
+    }
+
+    MAL_VM_CASE(JUMP)
+    {
+        pc = code[pc];
+        MAL_VM_DISPATCH();
+    }
+
+    MAL_VM_CASE(JUMP_IF_FALSE)
+    {
+        auto cond = pop();
+        if (cond->as_nil() || cond->as_false())
+            pc = code[pc];
+        else
+            pc++;
+        MAL_VM_DISPATCH();
+    }
+
+    // The value stays as the result if it jumps and is dropped otherwise.
+    MAL_VM_CASE(AND)
+    MAL_VM_CASE(OR)
+    {
+        bool is_false = stack_.back()->as_nil() || stack_.back()->as_false();
+        if (is_false == (static_cast<Op>(code[pc - 1]) == Op::AND)) {
+            pc = code[pc];
+        }
+        else {
+            pop();
+            pc++;
+        }
+        MAL_VM_DISPATCH();
+    }
+
+    MAL_VM_CASE(THROW) { MAL_THROW(pop()); }
+
+    MAL_VM_CASE(INLINED)
+    {
+        auto& generation = cf->code->generations[code[pc + 2]];
+        if (generation != Env::generation()) {
+            const auto& list = cf->code->consts[code[pc]];
+            auto body = list->as_list()->inlined(cf->env);
+            if (!body || !body->is_equal_to(cf->code->consts[code[pc + 1]])) {
+                pc = code[pc + 3];
+                MAL_VM_DISPATCH();
+            }
+            generation = Env::generation();
+        }
+        pc += 4;
+        MAL_VM_DISPATCH();
+    }
+
+    MAL_VM_CASE(FOLD)
+    {
+        const auto& list = cf->code->consts[code[pc]];
+        if (auto value = list->as_list()->fold(cf->env)) {
+            stack_.push_back(std::move(value));
+            pc = code[pc + 1];
+        }
+        else {
+            pc += 2;
+        }
+        MAL_VM_DISPATCH();
+    }
+
+    MAL_VM_CASE(ARITH)
+    {
+        const auto& func = cf->code->consts[code[pc]];
+        size_t argc = code[pc + 1];
+        auto& generation = cf->code->generations[code[pc + 3]];
+        if (generation != Env::generation()) {
+            auto value = cf->env->get(cf->code->names[code[pc + 2]]);
+            if (value != func) {  // let the following CALL call value
+                stack_.insert(stack_.end() - argc, std::move(value));
+                pc += 4;
+                MAL_VM_DISPATCH();
+            }
+            generation = Env::generation();
+        }
+        auto value = static_cast<const MalArithmetic&>(*func).apply(
+            MalFunction::Args(stack_.data() + stack_.size() - argc,
+                              stack_.data() + stack_.size()));
+        stack_.resize(stack_.size() - argc);
+        stack_.push_back(std::move(value));
+        pc += 6;  // over the CALL as well
+        MAL_VM_DISPATCH();
+    }
+
+    MAL_VM_CASE(CALL)
+    MAL_VM_CASE(TAIL_CALL)
+    {
+        bool tail = static_cast<Op>(code[pc - 1]) == Op::TAIL_CALL;
+        size_t argc = code[pc++];
+        size_t callee = stack_.size() - argc - 1;
+        auto func = stack_[callee]->as_function();
+        HOOLIB_THROW_UNLESS(func, "invalid list: not function");
+
+        while (func->is_apply()) {
+            auto [ target, list ] = mal::helper::apply_args(
+                MalFunction::Args(stack_.data() + callee + 1,
+                                  stack_.data() + stack_.size()));
+            stack_.resize(callee);
+            stack_.push_back(target);
+            stack_.insert(stack_.end(), HOOLIB_RANGE(list));
+            func = target;
+        }
+
+        auto closure = dynamic_cast<Closure*>(func.get());
+        if (!closure)  // a closure of mal_eval compiled by tiering
+            if (auto tiered = dynamic_cast<MalClosure*>(func.get()))
+                closure = dynamic_cast<Closure*>(tiered->tiered());
+        if (closure) {
+            const auto& new_code = closure->proto()->compiled(closure->env());
+            // A tail call leaves the caller's frame unused.
+            auto frame = closure->bind(
+                stack_.begin() + callee + 1, stack_.end(), *new_code,
+                tail ? &cf->frame : nullptr);
+            if (tail) {
+                stack_.resize(cf->base);
+                cf->code = new_code;
+                cf->frame = std::move(frame);
+                cf->env = closure->env();
+                cf->pc = 0;
+            }
+            else {
+                if ((calls_.size() + 1) * sizeof(CallFrame) > mal::stack_limit())
+                    MAL_THROW_STRING("stack overflow");
+                stack_.resize(callee);
+                cf->pc = pc;
+                calls_.push_back(
+                    CallFrame{new_code, 0, std::move(frame), closure->env(),
+                              callee});
+            }
+            MAL_VM_RELOAD();
+            MAL_VM_DISPATCH();
+        }
+
+        if (func->is_throw() && argc == 1 && !handlers_.empty()) {
+            handle(stack_.back());
+            MAL_VM_RELOAD();
+            MAL_VM_DISPATCH();
+        }
+
+        auto value = func->callN(MalFunction::Args(
+            stack_.data() + callee + 1, stack_.data() + stack_.size()));
+        stack_.resize(callee);
+        stack_.push_back(std::move(value));
+        if (!tail) MAL_VM_DISPATCH();
+    }
+    // A tail call to a builtin returns its value right away.
+
+    MAL_VM_CASE(RETURN)
+    {
+        auto value = pop();
+        stack_.resize(cf->base);
+        calls_.pop_back();
+        if (calls_.empty()) return value;
+        stack_.push_back(std::move(value));
+        MAL_VM_RELOAD();
+        MAL_VM_DISPATCH();
+    }
+
+    MAL_VM_CASE(MAKE_CLOSURE)
+    {
+        stack_.push_back(mal::make_shared<Closure>(
+            cf->code->protos[code[pc++]], cf->frame, cf->env));
+        MAL_VM_DISPATCH();
+    }
+
+    MAL_VM_CASE(MAKE_VECTOR)
+    {
+        size_t n = code[pc++];
+        std::vector<MalTypePtr> items(stack_.end() - n, stack_.end());
+        stack_.resize(stack_.size() - n);
+        stack_.push_back(mal::vector(std::move(items)));
+        MAL_VM_DISPATCH();
+    }
+
+    MAL_VM_CASE(MAKE_HASH_MAP)
+    {
+        size_t n = code[pc++] * 2;
+        auto container = mal::helper::make_hash_map_container(
+            stack_.end() - n, stack_.end());
+        stack_.resize(stack_.size() - n);
+        stack_.push_back(mal::hash_map(std::move(container)));
+        MAL_VM_DISPATCH();
+    }
+
+    MAL_VM_CASE(TRY_BEGIN)
+    {
+        uint32_t target = code[pc++], slot = code[pc++];
+        handlers_.push_back(
+            Handler{calls_.size() - 1, stack_.size(), target, slot});
+        MAL_VM_DISPATCH();
+    }
+
+    MAL_VM_CASE(TRY_END)
+    {
+        handlers_.pop_back();
+        MAL_VM_DISPATCH();
+    }
+
+#ifndef MAL_VM_COMPUTED_GOTO
+    }
+#endif
+
+#undef MAL_VM_CASE
+#undef MAL_VM_DISPATCH
+#undef MAL_VM_RELOAD
+}
+
+MalTypePtr Closure::callN(const Args& args)
+{
+    mal::EngineEntry entry;
+    const auto& code = proto_->compiled(env_);
+    auto frame = bind(args.begin(), args.end(), *code);
+
+    // Machines are reused as Evaluators are in mal_eval, since mal_eval calls
+    // closures compiled by tiering through here.
+    static std::vector<std::unique_ptr<Machine>> pool;
+
+    std::unique_ptr<Machine> machine;
+    if (pool.empty()) {
+        machine = std::make_unique<Machine>();
+    }
+    else {
+        machine = std::move(pool.back());
+        pool.pop_back();
+    }
+
+    struct Release {
+        std::unique_ptr<Machine>& machine;
+        ~Release()
+        {
+            machine->clear();
+            pool.push_back(std::move(machine));
+        }
+    } release{machine};
+
+    return machine->run(code, std::move(frame), env_);
+}
+
+// Checks on the evaluating thread that ast can be compiled without running
+// any code, i.e. it calls no macro, and copies the bindings it refers to
+// from env into globals. defmacro! is left to mal_eval, since it always
+// defines a global in the VM, and so are def! and macroexpand.
+bool prepare(const MalTypePtr& ast, const EnvPtr& env, Env& globals)
+{
+    if (auto symbol = ast->as_symbol()) {
+        if (auto value = env->get_if(symbol->name()))
+            globals.set(symbol->name(), value);
+        return true;
+    }
+
+    if (auto hash = ast->as_hash_map()) {
+        for (auto && [ key, value ] : hash->data())
+            if (!prepare(value, env, globals)) return false;
+        return true;
+    }
+
+    auto seq = ast->as_sequential();
+    if (!seq || seq->get().empty()) return true;
+    const auto& items = seq->get();
+    auto list = ast->as_list();
+    auto head = items[0]->as_symbol();
+    if (list && head) {
+        const auto& name = head->name();
+        if (name == "def!" || name == "defmacro!" || name == "macroexpand")
+            return false;
+        if (name == "quote") return true;
+        // The compiler takes the expansions cached here.
+        if (name == "quasiquote")
+            return prepare(list->quasiquoted(), env, globals);
+        if (name == "->" || name == "->>")
+            return prepare(list->threaded(), env, globals);
+        auto value = env->get_if(name);
+        auto func = value ? value->as_function() : nullptr;
+        if (func && func->is_macro()) return false;
+    }
+    for (auto&& item : items)
+        if (!prepare(item, env, globals)) return false;
+    return true;
+}
+
+// Closures of mal_eval are compiled on a thread of their own. The
+// evaluating thread prepares a Job and the compiler thread swaps the result
+// into the closure. Jobs are destroyed on the evaluating thread, since they
+// may hold the last references to ASTs and globals.
+class Tiering {
+private:
+    struct Job {
+        std::shared_ptr<MalClosure> closure;
+        EnvPtr globals;
+        uint64_t generation;
+        std::atomic<bool> is_done = false;
+    };
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<Job*> queue_;
+    bool is_stopping_ = false;
+    std::thread thread_;
+
+    // only on the evaluating thread
+    std::vector<std::unique_ptr<Job>> jobs_;
+
+    std::atomic<size_t> promoted_ = 0, rejected_ = 0;
+    std::atomic<uint64_t> compile_us_ = 0;
+
+public:
+    static Tiering& instance()
+    {
+        static Tiering tiering;
+        return tiering;
+    }
+
+    ~Tiering()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            is_stopping_ = true;
+        }
+        cv_.notify_one();
+        if (thread_.joinable()) thread_.join();
+    }
+
+    void submit(const std::shared_ptr<MalClosure>& closure)
+    {
+        collect();
+        auto job = std::make_unique<Job>();
+        job->closure = closure;
+        job->globals = mal::make_shared<Env>();
+        job->generation = Env::generation();
+        bool is_compilable = false;
+        try {
+            is_compilable = closure->is_sealed() &&
+                            prepare(closure->body(), closure->env(),
+                                    *job->globals);
+        }
+        catch (std::runtime_error&) {  // invalid forms
+        }
+        if (!is_compilable) {
+            rejected_++;
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!thread_.joinable()) thread_ = std::thread([this] { work(); });
+        queue_.push_back(job.get());
+        jobs_.push_back(std::move(job));
+        cv_.notify_one();
+    }
+
+    TieringStats stats()
+    {
+        collect();
+        return TieringStats{promoted_, rejected_, jobs_.size(),
+                            compile_us_};
+    }
+
+private:
+    void collect()
+    {
+        jobs_.erase(std::remove_if(jobs_.begin(), jobs_.end(),
+                                   [](auto&& job) {
+                                       return job->is_done.load(
+                                           std::memory_order_acquire);
+                                   }),
+                    jobs_.end());
+    }
+
+    void work()
+    {
+        while (true) {
+            Job* job;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                cv_.wait(lock,
+                         [this] { return is_stopping_ || !queue_.empty(); });
+                if (is_stopping_) return;
+                job = queue_.front();
+                queue_.pop_front();
+            }
+
+            auto start = std::chrono::steady_clock::now();
+            try {
+                auto& closure = *job->closure;
+                auto proto = std::make_shared<Proto>();
+                proto->params = closure.params();
+                proto->variadic = closure.is_variadic();
+                proto->body = closure.body();
+                auto code = std::make_shared<Code>();
+                Compiler(*code, job->globals, nullptr, job->generation)
+                    .compile_function(*proto);
+                proto->code = std::move(code);
+                closure.set_tiered(mal::make_shared<Closure>(
+                    std::move(proto), nullptr, closure.env()));
+                promoted_++;
+            }
+            catch (...) {  // e.g. recur not in tail position
+                rejected_++;
+            }
+            compile_us_ += std::chrono::duration_cast<std::chrono::microseconds>(
+                               std::chrono::steady_clock::now() - start)
+                               .count();
+            job->is_done.store(true, std::memory_order_release);
+        }
+    }
+};
+
+// The JIT, if it's on and can take the closure, is tried first.
+void tier_up(const std::shared_ptr<MalClosure>& closure)
+{
+    if (auto native = mal::jit::compile(closure)) {
+        closure->set_tiered(std::move(native));
+        return;
+    }
+    Tiering::instance().submit(closure);
+}
+
+bool is_do(const MalTypePtr& ast)
+{
+    auto list = ast->as_list();
+    if (!list || list->get().empty()) return false;
+    auto symbol = list->get()[0]->as_symbol();
+    return symbol && symbol->name() == "do";
+}
+
+}  // namespace
+
+void set_tiering(uint32_t threshold) { mal::set_tier_up(threshold, tier_up); }
+
+TieringStats tiering_stats() { return Tiering::instance().stats(); }
+
+MalTypePtr eval(MalTypePtr ast, EnvPtr env)
+{
+    HOOLIB_THROW_UNLESS(ast, "invalid ast");
+    ast = macroexpand(ast, env);
+
+    // Top-level forms of a do, e.g. the body of load-file, run one by one
+    // so that each is compiled after the macros defined before it.
+    if (is_do(ast)) {
+        const auto& items = ast->as_list()->get();
+        MalTypePtr ret = mal::nil();
+        for (auto it = items.begin() + 1; it != items.end(); ++it)
+            ret = eval(*it, env);
+        return ret;
+    }
+
+    mal::EngineEntry entry;
+    auto code = std::make_shared<Code>();
+    Compiler(*code, env, nullptr).compile_script(ast);
+    auto frame = std::make_shared<Frame>(code->nslots, nullptr);
+    return Machine().run(std::move(code), std::move(frame), std::move(env));
+}
+
+}  // namespace mal::vm
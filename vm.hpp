@@ -0,0 +1,29 @@
+#pragma once
+#ifndef MAL_VM_HPP
+#define MAL_VM_HPP
+
+#include "type.hpp"
+
+// Bytecode engine. A macroexpanded AST is compiled into a compact code
+// vector and run on a stack machine. Function bodies are compiled lazily on
+// their first call, so macros defined later are expanded as in mal_eval.
+// Unlike mal_eval, def! always defines a global.
+namespace mal::vm {
+MalTypePtr eval(MalTypePtr ast, EnvPtr env);
+
+// Tiered execution of mal_eval. A closure called threshold times is
+// compiled on a background thread while mal_eval keeps running it, and is
+// called as bytecode from then on. Closures that call macros or use def!
+// stay in mal_eval. 0 turns it off.
+void set_tiering(uint32_t threshold);
+
+struct TieringStats {
+    size_t promoted;  // compiled and swapped in
+    size_t rejected;  // not to be compiled
+    size_t pending;   // waiting for the compiler thread
+    uint64_t compile_us;
+};
+TieringStats tiering_stats();
+}  // namespace mal::vm
+
+#endif